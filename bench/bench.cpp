@@ -0,0 +1,208 @@
+#include "huffman.h"
+#include <cmath>
+#include <chrono>
+#include <random>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+#include <filesystem>
+
+// Runs zip and unzip repeatedly over the files of a directory and over synthetic inputs, reports throughput,
+// time per byte and compression ratio as text, CSV or JSON. The directory defaults to data/ of the source tree.
+//
+//     hw_02_bench [--data DIR] [--size MIB] [--repeat N] [--threads N] [--streams N] [--format text|csv|json]
+
+#ifndef HW_02_DATA_DIR
+#define HW_02_DATA_DIR "data"
+#endif
+
+struct Options {
+    std::string data = HW_02_DATA_DIR, format = "text";
+    size_t size = 16 << 20;
+    int repeat = 5, threads = 1, streams = huffman::HuffmanArchiver::default_streams;
+};
+
+struct Input {
+    std::string name;
+    std::string data;
+};
+
+struct Result {
+    std::string input, mode;
+    uint64_t size = 0, archive_size = 0;
+    double mean = 0, stddev = 0, ns_per_byte = 0;
+    int runs = 0;
+};
+
+static Options parse_options(int argc, char *argv[]) {
+    Options options;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (i + 1 == argc) throw std::invalid_argument("Missing value for " + arg);
+        std::string value = argv[++i];
+        if (arg == "--data") {
+            options.data = value;
+        } else if (arg == "--format" && (value == "text" || value == "csv" || value == "json")) {
+            options.format = value;
+        } else if (arg == "--size") {
+            options.size = std::stoull(value) << 20;
+        } else if (arg == "--repeat") {
+            options.repeat = std::max(1, std::stoi(value));
+        } else if (arg == "--threads") {
+            options.threads = std::stoi(value);
+        } else if (arg == "--streams") {
+            options.streams = std::stoi(value);
+        } else {
+            throw std::invalid_argument("Invalid option " + arg);
+        }
+    }
+    return options;
+}
+
+static std::vector<Input> load_inputs(const Options &options) {
+    std::vector<Input> inputs;
+    std::vector<std::filesystem::path> files;
+    std::error_code error;
+    if (!std::filesystem::is_directory(options.data, error)) throw std::invalid_argument("No data directory " + options.data);
+    for (const auto &entry : std::filesystem::directory_iterator(options.data)) {
+        if (entry.is_regular_file()) files.push_back(entry.path());
+    }
+    std::sort(files.begin(), files.end());
+    for (const auto &path : files) {
+        std::ifstream in(path, std::ios::binary);
+        inputs.push_back({path.filename().string(), std::string(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>())});
+    }
+
+    std::mt19937_64 random(2022);
+    std::string uniform(options.size, 0), skewed(options.size, 0);
+    for (char &ch : uniform) ch = char(random());
+    // Geometric distribution over the letters, roughly the entropy of English text.
+    std::geometric_distribution<int> letters(0.15);
+    for (char &ch : skewed) ch = char('a' + std::min(letters(random), 25));
+    inputs.push_back({"synthetic-uniform", std::move(uniform)});
+    inputs.push_back({"synthetic-skewed", std::move(skewed)});
+    inputs.push_back({"synthetic-single", std::string(options.size, 'x')});
+    return inputs;
+}
+
+template<class Action>
+static Result measure(const std::string &input, const std::string &mode, uint64_t size, int repeat, Action action) {
+    Result result{input, mode, size};
+    std::vector<double> rates, times;
+    for (int run = 0; run < repeat; run++) {
+        auto begin = std::chrono::steady_clock::now();
+        action();
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+        times.push_back(seconds);
+        rates.push_back(size / 1e6 / std::max(seconds, 1e-9));
+    }
+    for (double rate : rates) result.mean += rate / repeat;
+    for (double rate : rates) result.stddev += (rate - result.mean) * (rate - result.mean) / repeat;
+    result.stddev = std::sqrt(result.stddev);
+    double total = 0;
+    for (double seconds : times) total += seconds;
+    result.ns_per_byte = size == 0 ? 0 : total / repeat * 1e9 / size;
+    result.runs = repeat;
+    return result;
+}
+
+static std::vector<Result> run(const Options &options, const Input &input) {
+    huffman::HuffmanArchiver archiver;
+    archiver.set_threads(options.threads);
+    archiver.set_streams(options.streams);
+    // The in-memory overloads keep stream overhead out of the timings, the output vectors are reused across runs.
+    const uint8_t *data = reinterpret_cast<const uint8_t *>(input.data.data());
+    std::vector<uint8_t> archive, restored;
+    auto zip = [&]() {
+        archiver.zip(data, input.data.size(), archive);
+    };
+    auto unzip = [&]() {
+        archiver.unzip(archive.data(), archive.size(), restored);
+    };
+    Result zipped = measure(input.name, "zip", input.data.size(), options.repeat, zip);
+    Result unzipped = measure(input.name, "unzip", input.data.size(), options.repeat, unzip);
+    if (restored.size() != input.data.size() || !std::equal(restored.begin(), restored.end(), data)) {
+        throw std::runtime_error("Round trip failed for " + input.name);
+    }
+    zipped.archive_size = unzipped.archive_size = archive.size();
+    return {zipped, unzipped};
+}
+
+static double ratio(const Result &result) {
+    return result.size == 0 ? 0 : (double)result.archive_size / result.size;
+}
+
+// Quotes a CSV field, quotes inside it are doubled.
+static std::string csv_string(const std::string &text) {
+    std::string quoted = "\"";
+    for (char ch : text) {
+        if (ch == '"') quoted += '"';
+        quoted += ch;
+    }
+    return quoted + '"';
+}
+
+// Quotes a string for JSON, file names may hold quotes, backslashes and control characters.
+static std::string json_string(const std::string &text) {
+    std::string quoted = "\"";
+    for (char ch : text) {
+        if (ch == '"' || ch == '\\') {
+            quoted += '\\';
+            quoted += ch;
+        } else if ((unsigned char)ch < 0x20) {
+            char escape[7];
+            std::snprintf(escape, sizeof(escape), "\\u%04x", (unsigned char)ch);
+            quoted += escape;
+        } else {
+            quoted += ch;
+        }
+    }
+    return quoted + '"';
+}
+
+static void print(const Options &options, const std::vector<Result> &results) {
+    std::cout.setf(std::ios::fixed);
+    std::cout.precision(3);
+    if (options.format == "csv") {
+        std::cout << "input,mode,size,archive_size,ratio,mb_per_s,mb_per_s_stddev,ns_per_byte,runs\n";
+        for (const Result &r : results) {
+            std::cout << csv_string(r.input) << ',' << r.mode << ',' << r.size << ',' << r.archive_size << ',' << ratio(r) << ','
+                      << r.mean << ',' << r.stddev << ',' << r.ns_per_byte << ',' << r.runs << '\n';
+        }
+    } else if (options.format == "json") {
+        std::cout << "[\n";
+        for (size_t i = 0; i < results.size(); i++) {
+            const Result &r = results[i];
+            std::cout << "  {\"input\": " << json_string(r.input) << ", \"mode\": " << json_string(r.mode)
+                      << ", \"size\": " << r.size << ", \"archive_size\": " << r.archive_size << ", \"ratio\": " << ratio(r)
+                      << ", \"mb_per_s\": " << r.mean << ", \"mb_per_s_stddev\": " << r.stddev
+                      << ", \"ns_per_byte\": " << r.ns_per_byte << ", \"runs\": " << r.runs << '}'
+                      << (i + 1 < results.size() ? ",\n" : "\n");
+        }
+        std::cout << "]\n";
+    } else {
+        for (const Result &r : results) {
+            std::cout << r.input << ' ' << r.mode << ": " << r.size << " -> " << r.archive_size << " bytes (ratio "
+                      << ratio(r) << "), " << r.mean << " +- " << r.stddev << " MB/s, " << r.ns_per_byte << " ns/byte\n";
+        }
+    }
+}
+
+int main(int argc, char *argv[]) {
+#if defined(__GNUC__) && !defined(__OPTIMIZE__)
+    std::cerr << "warning: built without optimization, configure with -DCMAKE_BUILD_TYPE=Release\n";
+#endif
+    try {
+        Options options = parse_options(argc, argv);
+        std::vector<Result> results;
+        for (const Input &input : load_inputs(options)) {
+            for (Result &result : run(options, input)) results.push_back(std::move(result));
+        }
+        print(options, results);
+    } catch (std::exception &e) {
+        std::cerr << e.what() << '\n';
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,107 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include "byte_io.h"
+
+namespace huffman {
+
+    // Reads an MSB-first bitstream from a ByteReader and keeps up to 64 bits ready for peeking. The reader's window
+    // is cached locally, sync() reports the consumed bytes back to the ByteReader.
+    class BitReader {
+    private:
+        ByteReader &src;
+        const uint8_t *pos, *end;
+        uint64_t buf = 0;
+        int bits = 0;
+
+        static uint64_t load_be64(const uint8_t *p) {
+            uint64_t word;
+            std::memcpy(&word, p, sizeof(word));
+            return __builtin_bswap64(word);
+        }
+
+        bool next_window() {
+            sync();
+            bool more = src.fill();
+            pos = src.data();
+            end = pos + src.available();
+            return more;
+        }
+    public:
+        explicit BitReader(ByteReader &source) : src(source), pos(source.data()), end(source.data() + source.available()) {}
+
+        void refill() {
+            if (bits > 56) return;
+            if (end - pos >= 8) {
+                buf |= load_be64(pos) >> bits;
+                pos += (63 - bits) >> 3;
+                bits |= 56;
+                return;
+            }
+            while (bits <= 56) {
+                if (pos == end && !next_window()) return;
+                buf |= uint64_t(*pos++) << (56 - bits);
+                bits += 8;
+            }
+        }
+
+        uint64_t peek(int n) const {
+            return buf >> (64 - n);
+        }
+
+        void consume(int n) {
+            buf <<= n;
+            bits -= n;
+        }
+
+        int available() const {
+            return bits;
+        }
+
+        void sync() {
+            src.skip(pos - src.data());
+        }
+    };
+
+    // Packs an MSB-first bitstream into a 64-bit accumulator and stores whole words into a ByteWriter.
+    class BitWriter {
+    private:
+        ByteWriter &dst;
+        uint64_t acc = 0;
+        int bits = 0;
+
+        void put_word(uint64_t word) {
+            word = __builtin_bswap64(word);
+            dst.write(&word, sizeof(word));
+        }
+    public:
+        explicit BitWriter(ByteWriter &target) : dst(target) {}
+
+        // Appends the low len bits of code, len must not exceed 32.
+        void put(uint64_t code, int len) {
+            int free = 64 - bits;
+            if (len < free) {
+                acc |= code << (free - len);
+                bits += len;
+                return;
+            }
+            int rest = len - free;
+            put_word(acc | (code >> rest));
+            acc = rest ? code << (64 - rest) : 0;
+            bits = rest;
+        }
+
+        // Pads the last byte with zero bits and passes the remaining bytes to the ByteWriter.
+        void finish() {
+            while (bits > 0) {
+                dst.put(uint8_t(acc >> 56));
+                acc <<= 8;
+                bits -= 8;
+            }
+            acc = 0;
+            bits = 0;
+        }
+    };
+
+}
@@ -0,0 +1,131 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <streambuf>
+#include <ios>
+
+namespace huffman {
+
+    // Reads a stream buffer in large chunks. The current chunk is exposed as a contiguous window so that hot loops
+    // can consume bytes without a call per byte. A reader over memory exposes the whole range as a single chunk.
+    class ByteReader {
+    private:
+        std::streambuf *src = nullptr;
+        std::vector<uint8_t> storage;
+        const uint8_t *pos = nullptr, *end = nullptr;
+        uint64_t consumed = 0, waited = 0;
+    public:
+        ByteReader(std::streambuf *source, size_t buffer_size);
+        ByteReader(const uint8_t *data, size_t size);
+
+        // Loads the next chunk once the current one is exhausted. Returns false at the end of input.
+        bool fill();
+
+        const uint8_t * data() const {
+            return pos;
+        }
+
+        size_t available() const {
+            return end - pos;
+        }
+
+        void skip(size_t n) {
+            pos += n;
+            consumed += n;
+        }
+
+        // Number of bytes consumed so far.
+        uint64_t position() const {
+            return consumed;
+        }
+
+        // Nanoseconds spent waiting for the stream buffer.
+        uint64_t wait_time() const {
+            return waited;
+        }
+
+        // Copies up to n bytes and returns how many were copied.
+        size_t read(void *dst, size_t n);
+
+        // Copies exactly n bytes, throws std::ios_base::failure if the input ends first.
+        void read_exact(void *dst, size_t n);
+    };
+
+    // Collects output in a buffer of the configured size and hands it to the stream buffer in one call once full.
+    // A writer over memory stores straight into the given range and fails once it is exhausted, a writer over
+    // a vector grows it as needed (flush trims the vector to the written size).
+    class ByteWriter {
+    private:
+        std::streambuf *dst = nullptr;
+        std::vector<uint8_t> *sink = nullptr;
+        std::vector<uint8_t> storage;
+        uint8_t *buf = nullptr;
+        size_t capacity = 0, used = 0;
+        uint64_t flushed = 0, waited = 0;
+
+        // Makes room in a full buffer: flushes to the stream buffer, fails for a writer over memory.
+        void spill();
+    public:
+        ByteWriter(std::streambuf *target, size_t buffer_size);
+        ByteWriter(uint8_t *data, size_t size);
+        explicit ByteWriter(std::vector<uint8_t> &target);
+
+        void put(uint8_t byte) {
+            if (used == capacity) spill();
+            buf[used++] = byte;
+        }
+
+        void write(const void *src, size_t n) {
+            if (n <= capacity - used) {
+                std::memcpy(buf + used, src, n);
+                used += n;
+                return;
+            }
+            write_slow(src, n);
+        }
+
+        // Returns room for n bytes (n must not exceed the buffer size), commit tells how many were actually used.
+        uint8_t * reserve(size_t n) {
+            if (n > capacity - used) spill();
+            if (n > capacity - used) throw std::ios_base::failure("Output buffer is full");
+            return buf + used;
+        }
+
+        void commit(size_t n) {
+            used += n;
+        }
+
+        // Bytes that can be written before the buffer has to be flushed or grown.
+        size_t room() const {
+            return capacity - used;
+        }
+
+        void write_slow(const void *src, size_t n);
+        void fill(uint8_t byte, uint64_t n);
+
+        // Passes everything buffered to the stream buffer, throws std::ios_base::failure if it is not accepted.
+        void flush();
+
+        // Number of bytes written so far, including the buffered ones.
+        uint64_t position() const {
+            return flushed + used;
+        }
+
+        // Nanoseconds spent waiting for the stream buffer.
+        uint64_t wait_time() const {
+            return waited;
+        }
+    };
+
+    // Unsigned LEB128: seven bits per byte, least significant group first, the high bit marks a continuation.
+    static constexpr size_t max_varint_size = 10;
+
+    size_t varint_size(uint64_t value);
+    void write_varint(ByteWriter &out, uint64_t value);
+
+    // Throws std::ios_base::failure on truncated input or on encodings that do not fit in 64 bits.
+    uint64_t read_varint(ByteReader &in);
+
+}
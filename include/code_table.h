@@ -0,0 +1,131 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include "byte_io.h"
+
+namespace huffman {
+
+    // Assigns canonical codes: shorter codes first, equal lengths ordered by symbol. Zero length means absent symbol.
+    // Lengths must not exceed 64. The second form writes into codes, reusing its memory.
+    std::vector<uint64_t> canonical_codes(const std::vector<uint8_t> &lengths);
+    void canonical_codes(const std::vector<uint8_t> &lengths, std::vector<uint64_t> &codes);
+
+    struct EncodeEntry {
+        uint32_t code = 0;
+        uint8_t length = 0;
+    };
+
+    // Working memory of package_merge, kept by callers that build many codes.
+    struct MergeScratch {
+        std::vector<uint32_t> leaves;
+        std::vector<uint64_t> prev, cur;
+        std::vector<bool> is_leaf;
+    };
+
+    // Optimal code lengths bounded by max_length (package-merge). Requires 2^max_length >= number of present symbols.
+    std::vector<uint8_t> package_merge(const std::vector<uint64_t> &freq, int max_length);
+    void package_merge(const std::vector<uint64_t> &freq, int max_length, std::vector<uint8_t> &lengths, MergeScratch &scratch);
+
+    // Code lengths header: number of present symbols, then their symbols (sparse list or bitmap) and packed lengths.
+    // The alphabet is at most 256 symbols.
+    void write_code_lengths(ByteWriter &out, const std::vector<uint8_t> &lengths);
+    std::vector<uint8_t> read_code_lengths(ByteReader &in, size_t alphabet);
+    void read_code_lengths(ByteReader &in, size_t alphabet, std::vector<uint8_t> &lengths);
+
+    // Code lengths of an alphabet whose symbols are all present, such as a token lexicon: a flag byte, then one
+    // nibble or one byte per symbol. The alphabet may be of any size.
+    void write_dense_lengths(ByteWriter &out, const std::vector<uint8_t> &lengths);
+    void read_dense_lengths(ByteReader &in, size_t alphabet, std::vector<uint8_t> &lengths);
+
+    // Multi-level lookup table for canonical prefix codes. The first root_bits bits of the input select an entry
+    // which either resolves a symbol with its code length or points to a second-level table for longer codes.
+    // Codes that do not fit into root_bits + max_sub_bits are marked as slow and are resolved by decode_slow.
+    class DecodeTable {
+    private:
+        static constexpr int max_length = 64;
+
+        std::vector<uint32_t> entries;
+        std::vector<uint32_t> sorted;
+        std::vector<uint64_t> codes;
+        uint64_t first_code[max_length + 1] = {};
+        uint32_t first_index[max_length + 1] = {};
+        uint32_t count[max_length + 1] = {};
+        int longest = 0;
+    public:
+        static constexpr int root_bits = 11;
+        static constexpr int max_sub_bits = 10;
+
+        static constexpr uint32_t link_flag = 0x80;
+        static constexpr uint32_t length_mask = 0x7F;
+
+        DecodeTable() = default;
+        explicit DecodeTable(const std::vector<uint8_t> &lengths);
+
+        // Replaces the table with the one for lengths, reusing the memory of the previous table. A root smaller than
+        // root_bits gives a table that takes less cache, its decoder must look up the first root bits instead.
+        void build(const std::vector<uint8_t> &lengths, int root = root_bits);
+
+        uint32_t operator[](uint32_t idx) const {
+            return entries[idx];
+        }
+
+        // Lookup entries, the root table followed by the second-level tables.
+        const uint32_t * data() const {
+            return entries.data();
+        }
+
+        size_t size() const {
+            return entries.size();
+        }
+
+        int longest_code() const {
+            return longest;
+        }
+
+        // Bit-serial canonical decoding of the MSB-aligned window. Returns the code length, or 0 if the window
+        // holds no complete code within the available bits.
+        uint32_t decode_slow(uint64_t window, int available, uint32_t &symbol) const;
+
+        static bool is_slow(uint32_t entry) {
+            return entry == 0;
+        }
+
+        static bool is_link(uint32_t entry) {
+            return entry & link_flag;
+        }
+
+        static uint32_t length(uint32_t entry) {
+            return entry & length_mask;
+        }
+
+        static uint32_t value(uint32_t entry) {
+            return entry >> 8;
+        }
+    };
+
+    // Read-only view of the lookup entries of a decode table kept elsewhere, such as in a mapped dictionary. Only
+    // tables whose codes fit into root_bits + max_sub_bits can be viewed, they have no slow entries.
+    class DecodeView {
+    private:
+        const uint32_t *entries;
+        int longest;
+    public:
+        static constexpr int root_bits = DecodeTable::root_bits;
+
+        DecodeView(const uint32_t *table, int longest_code) : entries(table), longest(longest_code) {}
+
+        uint32_t operator[](uint32_t idx) const {
+            return entries[idx];
+        }
+
+        int longest_code() const {
+            return longest;
+        }
+
+        uint32_t decode_slow(uint64_t, int, uint32_t &) const {
+            return 0;
+        }
+    };
+
+}
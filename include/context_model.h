@@ -0,0 +1,23 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+namespace huffman {
+
+    // Working memory of cluster_contexts, kept by callers that cluster many blocks.
+    struct ClusterScratch {
+        std::vector<uint32_t> symbols, counts, starts, order;
+        std::vector<uint64_t> totals;
+        std::vector<float> costs;
+    };
+
+    // Groups the 256 order-1 contexts, given as pair counts indexed by previous << 8 | byte, into at most max_clusters
+    // clusters of similar byte distributions (max_clusters must not exceed 256). contexts receives the cluster of
+    // every context, contexts that never occur go to cluster 0. freq receives the byte counts of every cluster,
+    // 256 per cluster, every cluster is used by some context. Returns the number of clusters.
+    size_t cluster_contexts(const std::vector<uint32_t> &pairs, size_t max_clusters, std::vector<uint8_t> &contexts,
+                            std::vector<uint64_t> &freq, ClusterScratch &scratch);
+
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include "code_table.h"
+#include "mapped_file.h"
+
+namespace huffman {
+
+    // Code trained offline and shared by the messages coded against it, which carry the dictionary id in place of
+    // their code lengths. A dictionary file holds the code lengths together with ready-built encode and decode tables
+    // in their in-memory layout: coding uses the mapped tables in place and processes that map the same file share
+    // its pages. Every byte value has a code, so any message can be coded against any dictionary.
+    class Dictionary {
+    private:
+        MappedFile file;
+        std::vector<uint32_t> storage;
+        const uint8_t *image = nullptr;
+        size_t image_size = 0;
+
+        Dictionary() = default;
+
+        // Lays out the image of a dictionary for a complete code.
+        static Dictionary build(const std::vector<uint8_t> &lengths);
+    public:
+        static constexpr size_t alphabet = 256;
+        static constexpr int min_code_length = 8;
+        static constexpr int max_code_length = DecodeTable::root_bits + DecodeTable::max_sub_bits;
+
+        // Builds a dictionary from byte counts of sample data, codes are limited to max_length bits. Bytes missing
+        // from the samples get the longest codes. Throws std::invalid_argument if max_length is out of range.
+        static Dictionary train(const std::vector<uint64_t> &freq, int max_length);
+
+        // Maps a dictionary file and checks its tables against its code lengths. Throws std::ios_base::failure if the
+        // file can not be read or is not a valid dictionary.
+        static Dictionary load(const std::string &path);
+
+        void save(const std::string &path) const;
+
+        // Bytes of the image, which is the size of the dictionary file.
+        size_t size() const {
+            return image_size;
+        }
+
+        // Hash of the code lengths, equal dictionaries have equal ids.
+        uint32_t id() const;
+
+        // Tables of alphabet entries indexed by byte value.
+        const uint8_t * code_lengths() const;
+        const EncodeEntry * encode_table() const;
+
+        DecodeView decode_table() const;
+    };
+
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include "thread_pool.h"
+
+namespace huffman {
+
+    // Adds the number of occurrences of every byte value in data to freq, which must hold 256 counters.
+    void count_frequencies(const uint8_t *data, size_t size, std::vector<uint64_t> &freq);
+
+    // Same result as the sequential count: data is split into up to parts slices that are counted on the pool into
+    // private tables, which are then summed. Must not be called from a task of the same pool.
+    void count_frequencies(const uint8_t *data, size_t size, std::vector<uint64_t> &freq, ThreadPool &pool, int parts);
+
+    // Adds the number of occurrences of every pair of consecutive bytes to pairs, indexed by previous << 8 | byte,
+    // which must hold 65536 counters. The first byte is counted with a previous byte of zero. Counters are 32-bit,
+    // so size must stay below 2^32.
+    void count_pairs(const uint8_t *data, size_t size, std::vector<uint32_t> &pairs);
+
+}
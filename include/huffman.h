@@ -3,51 +3,195 @@
 #include <map>
 #include <vector>
 #include <memory>
+#include <string>
 #include <iostream>
+#include <functional>
+#include "code_table.h"
+#include "byte_io.h"
 
 namespace huffman {
 
+    // Nanoseconds spent in each phase. Phases run by worker threads are summed over all tasks, so with several
+    // threads they can add up to more than the elapsed time. io is the time spent waiting on the input and output:
+    // reading and writing streams, or mapping, creating and syncing files (page faults count towards coding).
+    struct PhaseTimes {
+        uint64_t histogram = 0, tree = 0, table = 0, coding = 0, io = 0;
+
+        PhaseTimes & operator+=(const PhaseTimes &other) {
+            histogram += other.histogram;
+            tree += other.tree;
+            table += other.table;
+            coding += other.coding;
+            io += other.io;
+            return *this;
+        }
+    };
+
     struct StatHandler {
-        int inputData = 0, outputData = 0, additionalData = 0;
+        uint64_t inputData = 0, outputData = 0, additionalData = 0;
+        PhaseTimes time;
     };
 
+    // Node of the flat tree layout: children are indices into the owning HuffTree's node array, depth is the
+    // distance from the root.
     struct TreeNode {
-        int val = 0;
+        static constexpr uint16_t none = UINT16_MAX;
+
+        uint64_t val = 0;
+        uint16_t left = none, right = none;
         char ch = 0;
-        std::unique_ptr<TreeNode> left, right;
+        uint8_t depth = 0;
 
         TreeNode() = default;
-        explicit TreeNode(char chr, int cnt) : val(cnt), ch(chr) {}
-        TreeNode(std::unique_ptr<TreeNode> &l, std::unique_ptr<TreeNode> &r) : val(l->val + r->val), left(std::move(l)), right(std::move(r)) {}
+        explicit TreeNode(char chr, uint64_t cnt) : val(cnt), ch(chr) {}
+        TreeNode(uint16_t l, uint16_t r, uint64_t cnt) : val(cnt), left(l), right(r) {}
+
+        bool is_leaf() const {
+            return left == none;
+        }
     };
 
     class HuffTree {
     private:
         int size = 0;
-        std::vector<int> chars;
-        std::unique_ptr<TreeNode> root;
+        std::vector<uint64_t> chars;
+        std::vector<TreeNode> nodes;
+        uint16_t root = TreeNode::none;
+
+        uint16_t add_node(const TreeNode &node);
     public:
         HuffTree() = default;
-        explicit HuffTree(const std::vector<int> &freq);
+        explicit HuffTree(const std::vector<uint64_t> &freq);
+
+        // Replaces the tree with the one for freq, reusing the memory of the previous tree.
+        void build(const std::vector<uint64_t> &freq);
+
+        static HuffTree canonical(const std::vector<uint8_t> &lengths);
+        static HuffTree extract(ByteReader &in, uint64_t &cnt);
+
+        std::vector<uint8_t> code_lengths() const;
+        std::vector<uint8_t> code_lengths(int max_length) const;
+        void code_lengths(int max_length, std::vector<uint8_t> &lengths, MergeScratch &scratch) const;
+        void archive(ByteWriter &out) const;
+        void archive(ByteWriter &out, const std::vector<uint8_t> &lengths) const;
+        StatHandler decode_reference(ByteReader &in, ByteWriter &out, uint64_t cnt) const;
 
-        void archive(std::ofstream &out) const;
-        StatHandler decode(std::ifstream &in, std::ofstream &out, int cnt) const;
+        const TreeNode * get_root() const {
+            return root == TreeNode::none ? nullptr : &nodes[root];
+        }
+
+        const TreeNode * get_left(const TreeNode *node) const {
+            return &nodes[node->left];
+        }
 
-        TreeNode * get_root() const {
-            return root.get();
+        const TreeNode * get_right(const TreeNode *node) const {
+            return &nodes[node->right];
         }
     };
 
+    struct Workspace;
+    class Dictionary;
+
+    // Archives are a sequence of independently coded blocks, each one framed by the byte size of its body and
+    // carrying its own code lengths. Blocks are compressed and decompressed on a pool of worker threads and the
+    // results are written in input order. An archiver keeps its pool and scratch memory between calls, so it must
+    // not be used from several threads at once.
+    //
+    // set_contexts, set_tokens and set_symbol_width make every block also try another coding and keep it only if it
+    // is smaller. Every block and adaptive chunk header tells how it is coded, so unzip needs none of these settings.
     class HuffmanArchiver {
     private:
-        std::unique_ptr<HuffTree> tree;
-        std::vector<std::vector<bool>> table;
+        int max_code_length = default_max_code_length;
+        size_t buffer_size = default_buffer_size;
+        size_t block_size = default_block_size;
+        int streams = default_streams;
+        int threads = 1;
+        bool adaptive = false;
+        bool contexts = false;
+        bool tokens = false;
+        int symbol_width = 1;
+        bool indexed = false;
+        std::shared_ptr<const Dictionary> dictionary;
+        std::unique_ptr<Workspace> workspace;
+
+        // Cores of the memory and file variants, the output buffer is requested from allocate once its size is known.
+        using Allocator = std::function<uint8_t *(size_t)>;
+        StatHandler zip_memory(const uint8_t *data, size_t size, const Allocator &allocate);
+        StatHandler unzip_memory(const uint8_t *data, size_t size, const Allocator &allocate);
     public:
-        HuffmanArchiver() = default;
+        static constexpr int default_max_code_length = 15;
+        static constexpr int max_supported_code_length = 32;
+        static constexpr size_t default_buffer_size = 1 << 18;
+        static constexpr size_t min_buffer_size = 1 << 12;
+        static constexpr size_t max_buffer_size = 1 << 30;
+        static constexpr size_t default_block_size = 1 << 20;
+        static constexpr size_t min_block_size = 1 << 12;
+        static constexpr size_t max_block_size = 1 << 26;
+        static constexpr int default_streams = 4;
+        static constexpr int max_streams = 8;
+        static constexpr int max_threads = 256;
+
+        HuffmanArchiver();
+        HuffmanArchiver(HuffmanArchiver &&other) noexcept;
+        HuffmanArchiver & operator=(HuffmanArchiver &&other) noexcept;
+        ~HuffmanArchiver();
+
+        void set_max_code_length(int length);
+        void set_buffer_size(size_t size);
+        void set_block_size(size_t size);
+        void set_streams(int count);
+        void set_threads(int count);
+
+        // Adaptive mode codes the input in chunks with a code rebuilt from the data seen so far, nothing about the
+        // code is stored and output starts after the first chunk.
+        void set_adaptive(bool enabled);
+
+        // Order-1 context modeling: codes are chosen by the preceding byte, with the 256 contexts grouped into a few
+        // clusters of similar statistics. Slower to compress, decoding switches tables per symbol.
+        void set_contexts(bool enabled);
+
+        // Text mode: words and the runs of bytes between them are coded as symbols of the block's own vocabulary,
+        // stored as a front-coded lexicon. Decoding emits a whole token per symbol.
+        void set_tokens(bool enabled);
+
+        // Symbol width in bytes, 1, 2 or 4. With 2 or 4 the 16-bit or 32-bit integers of a block, in native byte
+        // order, are coded over the sparse alphabet of the values present in it. Bytes after the last whole integer
+        // are stored as they are. Throws std::invalid_argument for other widths.
+        void set_symbol_width(int bytes);
+
+        // Appends an index of the blocks after the end of the archive, so that unzip_range can find them directly.
+        void set_index(bool enabled);
+
+        // Codes blocks against a shared dictionary: they carry its id in place of code lengths and unzip needs the same
+        // dictionary to decode them. A null dictionary returns to per-block codes. Adaptive archives do not use it.
+        void set_dictionary(std::shared_ptr<const Dictionary> shared);
+
+        // Stream variants read the input once and never seek, so pipes and standard input work as well as files.
+        StatHandler zip(std::istream &in, std::ostream &out);
+        StatHandler unzip(std::istream &in, std::ostream &out);
+
+        // In-memory variants over a contiguous input. With a single thread they allocate nothing once the archiver
+        // has coded messages of the same kind before. The result replaces the contents of a vector, which is resized
+        // to fit, or is written to out[0, capacity), which throws std::ios_base::failure if it does not fit. The
+        // result takes outputData + additionalData bytes when zipping and outputData bytes when unzipping.
+        StatHandler zip(const uint8_t *data, size_t size, std::vector<uint8_t> &out);
+        StatHandler zip(const uint8_t *data, size_t size, uint8_t *out, size_t capacity);
+        StatHandler unzip(const uint8_t *data, size_t size, std::vector<uint8_t> &out);
+        StatHandler unzip(const uint8_t *data, size_t size, uint8_t *out, size_t capacity);
+
+        // Memory-mapped variants: the input is mapped read-only and the output is preallocated and written in place.
+        StatHandler zip_file(const std::string &input, const std::string &output);
+        StatHandler unzip_file(const std::string &input, const std::string &output);
+
+        // Decodes bytes [start, start + length) of the original data, only the blocks covering them are decoded.
+        // The archive is mapped into memory and located through its index, or through the block headers if it has
+        // none. Throws std::invalid_argument if the range exceeds the data.
+        StatHandler unzip_range(const std::string &input, std::ostream &out, uint64_t start, uint64_t length);
 
-        void build_table(TreeNode *root, std::vector<bool> &cur_code);
-        StatHandler zip(std::ifstream &in, std::ofstream &out);
-        StatHandler unzip(std::ifstream &in, std::ofstream &out);
+        // Trains a dictionary on a sample file, or on every regular file under a sample directory, and saves it to
+        // output. The samples are streamed in slices of the block size that are counted on the pool, codes are
+        // limited to the maximum code length. Statistics report the sample bytes and the dictionary file size.
+        StatHandler train(const std::string &samples, const std::string &output);
     };
 
 }
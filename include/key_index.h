@@ -0,0 +1,69 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <algorithm>
+
+namespace huffman {
+
+    // Gives the distinct keys of a sequence dense ids in order of appearance, the keys themselves are kept by the
+    // caller under their ids. Open addressing, the table is kept at most half full. Slots are picked by the high bits
+    // of a 64-bit hash, the low bits of a product only depend on the low bits of the key.
+    class KeyIndex {
+    private:
+        static constexpr int initial_bits = 12;
+
+        std::vector<uint32_t> slots;
+        int bits = initial_bits;
+        size_t mask = 0;
+
+        size_t slot_of(uint64_t hash) const {
+            return hash >> (64 - bits);
+        }
+    public:
+        static constexpr uint32_t empty = UINT32_MAX;
+
+        void clear() {
+            bits = initial_bits;
+            mask = (size_t(1) << bits) - 1;
+            slots.assign(mask + 1, empty);
+        }
+
+        // Returns the slot of the key with the given hash, equal(id) tells whether id is the id of that key. The slot
+        // holds empty for a new key, the caller then stores the next id in it and calls added.
+        template<class Equal>
+        uint32_t & find(uint64_t hash, Equal equal) {
+            size_t pos = slot_of(hash);
+            while (slots[pos] != empty && !equal(slots[pos])) pos = (pos + 1) & mask;
+            return slots[pos];
+        }
+
+        // Doubles the table once size keys fill half of it, hash(id) gives the hash of the key of every id.
+        template<class Hash>
+        void added(size_t size, Hash hash) {
+            if (2 * size <= mask) return;
+            bits++;
+            mask = (size_t(1) << bits) - 1;
+            slots.assign(mask + 1, empty);
+            for (uint32_t id = 0; id < size; id++) {
+                size_t pos = slot_of(hash(id));
+                while (slots[pos] != empty) pos = (pos + 1) & mask;
+                slots[pos] = id;
+            }
+        }
+    };
+
+    // Renumbers the ids of size keys in the order given by less on the old ids. Afterwards order[id] is the old id of
+    // every new one, remap is working memory.
+    template<class Less>
+    void sort_ids(size_t size, std::vector<uint32_t> &ids, std::vector<uint32_t> &order, std::vector<uint32_t> &remap, Less less) {
+        order.resize(size);
+        for (uint32_t id = 0; id < size; id++) order[id] = id;
+        std::sort(order.begin(), order.end(), less);
+        remap.resize(size);
+        for (uint32_t id = 0; id < size; id++) remap[order[id]] = id;
+        for (uint32_t &id : ids) id = remap[id];
+    }
+
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <string>
+#include <cstdint>
+#include <cstddef>
+
+namespace huffman {
+
+    // RAII wrapper around a memory-mapped file. Mapping failures are reported as std::ios_base::failure.
+    class MappedFile {
+    private:
+        int fd = -1;
+        uint8_t *addr = nullptr;
+        size_t length = 0;
+
+        MappedFile(int descriptor, size_t size, bool writable);
+    public:
+        MappedFile() = default;
+        MappedFile(const MappedFile &) = delete;
+        MappedFile(MappedFile &&other) noexcept;
+        MappedFile & operator=(const MappedFile &) = delete;
+        MappedFile & operator=(MappedFile &&other) noexcept;
+        ~MappedFile();
+
+        // Maps an existing file read-only and advises the kernel of sequential access.
+        static MappedFile open_read(const std::string &path);
+
+        // Creates (or truncates) a file, preallocates size bytes and maps it for writing.
+        static MappedFile create(const std::string &path, size_t size);
+
+        const uint8_t * data() const {
+            return addr;
+        }
+
+        uint8_t * data() {
+            return addr;
+        }
+
+        size_t size() const {
+            return length;
+        }
+
+        // Unmaps the file and cuts it to final_size bytes, which must not exceed the mapped size.
+        void close(size_t final_size);
+    };
+
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include "byte_io.h"
+#include "key_index.h"
+
+namespace huffman {
+
+    // Largest alphabet of a block of wide symbols, its indices are coded and decoded like token indices.
+    static constexpr size_t max_symbol_alphabet = 1 << 20;
+
+    // Symbols present in a block of fixed-width integers in native byte order, in increasing order with the number of
+    // occurrences of each, and the block as a sequence of alphabet indices. The remaining members are working memory:
+    // 16-bit symbols are counted and indexed through tables over the whole alphabet, 32-bit symbols through a hash
+    // table of the present ones.
+    template<class Symbol>
+    struct SymbolAlphabet {
+        std::vector<Symbol> symbols;
+        std::vector<uint64_t> counts;
+        std::vector<uint32_t> ids;
+        KeyIndex index;
+        std::vector<uint32_t> order, remap;
+        std::vector<Symbol> found;
+        std::vector<uint64_t> found_counts;
+    };
+
+    // Splits data into count symbols of type Symbol (uint16_t or uint32_t). Gives up and returns false once the
+    // alphabet grows past alphabet_limit.
+    template<class Symbol>
+    bool count_symbols(const uint8_t *data, size_t count, size_t alphabet_limit, SymbolAlphabet<Symbol> &alphabet);
+
+    // Sparse alphabet: the first symbol, then the gap to every next symbol less one, all varints.
+    template<class Symbol>
+    void write_alphabet(ByteWriter &out, const std::vector<Symbol> &symbols);
+
+    // Reads count symbols, throws std::ios_base::failure unless they are increasing and fit into Symbol.
+    template<class Symbol>
+    void read_alphabet(ByteReader &in, size_t count, std::vector<Symbol> &symbols);
+
+}
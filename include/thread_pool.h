@@ -0,0 +1,69 @@
+#pragma once
+
+#include <deque>
+#include <mutex>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <future>
+#include <functional>
+#include <condition_variable>
+
+namespace huffman {
+
+    // Fixed set of worker threads fed from a FIFO queue. A pool of a single thread has no workers and runs every
+    // task inline in submit, so the single-threaded path does not pay for synchronisation. Exceptions thrown by
+    // a task are passed to the caller through its future. The destructor finishes the queued tasks.
+    class ThreadPool {
+    private:
+        std::vector<std::thread> workers;
+        std::deque<std::function<void()>> tasks;
+        std::mutex lock;
+        std::condition_variable ready;
+        bool stopping = false;
+
+        void run();
+    public:
+        explicit ThreadPool(int threads);
+        ThreadPool(const ThreadPool &) = delete;
+        ThreadPool & operator=(const ThreadPool &) = delete;
+        ~ThreadPool();
+
+        template<class Task>
+        auto submit(Task task) -> std::future<decltype(task())> {
+            auto job = std::make_shared<std::packaged_task<decltype(task())()>>(std::move(task));
+            auto result = job->get_future();
+            if (workers.empty()) {
+                (*job)();
+                return result;
+            }
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                tasks.emplace_back([job]() { (*job)(); });
+            }
+            ready.notify_one();
+            return result;
+        }
+
+        // Number of worker threads, zero when tasks run inline.
+        size_t size() const {
+            return workers.size();
+        }
+
+        // Runs task(i) for every i below count and waits for all of them before passing on the first exception.
+        // Without workers the tasks run inline and nothing is allocated.
+        template<class Task>
+        void for_each(size_t count, const Task &task) {
+            if (workers.empty()) {
+                for (size_t i = 0; i < count; i++) task(i);
+                return;
+            }
+            std::vector<std::future<void>> done;
+            done.reserve(count);
+            for (size_t i = 0; i < count; i++) done.push_back(submit([&task, i]() { task(i); }));
+            for (auto &result : done) result.wait();
+            for (auto &result : done) result.get();
+        }
+    };
+
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+
+namespace huffman {
+
+    // Adds the time spent in its scope, in nanoseconds, to a counter.
+    class ScopedTimer {
+    private:
+        uint64_t &total;
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    public:
+        explicit ScopedTimer(uint64_t &counter) : total(counter) {}
+        ScopedTimer(const ScopedTimer &) = delete;
+        ScopedTimer & operator=(const ScopedTimer &) = delete;
+
+        ~ScopedTimer() {
+            total += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+        }
+    };
+
+}
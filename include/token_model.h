@@ -0,0 +1,52 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include "byte_io.h"
+#include "code_table.h"
+#include "key_index.h"
+
+namespace huffman {
+
+    // Tokens are words (letters, digits and bytes above 0x7F) and runs of the other bytes, split after
+    // max_token_size bytes. A token is kept in token_slot bytes: its text padded with zeros, its length in the last byte.
+    static constexpr size_t max_token_size = 15;
+    static constexpr size_t token_slot = max_token_size + 1;
+
+    // Largest vocabulary of a block, token indices must fit into the symbol field of a decode table entry.
+    static constexpr size_t max_vocabulary = 1 << 20;
+
+    // Vocabulary of a block in lexicographic order with the number of occurrences of every token, and the block
+    // as a sequence of vocabulary indices. The remaining members are working memory.
+    struct Tokens {
+        std::vector<uint8_t> lexicon;
+        std::vector<uint64_t> counts;
+        std::vector<uint32_t> ids;
+        std::vector<uint8_t> keys;
+        std::vector<uint64_t> found;
+        KeyIndex index;
+        std::vector<uint32_t> order, remap;
+    };
+
+    // Splits data into tokens. Gives up and returns false once the vocabulary grows past vocabulary_limit, or once
+    // more than half of the tokens are distinct after the first few thousand.
+    bool tokenize(const uint8_t *data, size_t size, size_t vocabulary_limit, Tokens &tokens);
+
+    // Working memory of write_lexicon and read_lexicon, kept by callers that code many blocks.
+    struct LexiconScratch {
+        std::vector<uint8_t> bytes, lengths;
+        std::vector<uint64_t> freq, codes;
+        MergeScratch merge;
+        DecodeTable table;
+    };
+
+    // Front coding of a sorted lexicon: every token is given as one byte holding the length of the prefix it shares
+    // with the previous token and the length of the rest, both nibbles, followed by the rest. These bytes are stored
+    // Huffman coded, as [code lengths][bitstream], with codes short enough to be resolved by a single table lookup.
+    void write_lexicon(ByteWriter &out, const std::vector<uint8_t> &lexicon, LexiconScratch &scratch);
+
+    // Reads count tokens into slots from all of data, throws std::ios_base::failure if the lexicon is malformed.
+    void read_lexicon(const uint8_t *data, size_t size, size_t count, std::vector<uint8_t> &lexicon, LexiconScratch &scratch);
+
+}
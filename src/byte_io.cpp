@@ -0,0 +1,125 @@
+#include "byte_io.h"
+#include "timer.h"
+#include <ios>
+#include <algorithm>
+
+namespace huffman {
+
+    ByteReader::ByteReader(std::streambuf *source, size_t buffer_size) : src(source), storage(buffer_size) {
+        pos = end = storage.data();
+    }
+
+    ByteReader::ByteReader(const uint8_t *data, size_t size) : pos(data), end(data + size) {}
+
+    bool ByteReader::fill() {
+        if (pos != end) return true;
+        if (src == nullptr) return false;
+        ScopedTimer timer(waited);
+        pos = end = storage.data();
+        end += src->sgetn((char *)storage.data(), (std::streamsize)storage.size());
+        return pos != end;
+    }
+
+    size_t ByteReader::read(void *dst, size_t n) {
+        size_t copied = 0;
+        while (copied < n && fill()) {
+            size_t part = std::min(n - copied, available());
+            std::memcpy((uint8_t *)dst + copied, pos, part);
+            skip(part);
+            copied += part;
+        }
+        return copied;
+    }
+
+    void ByteReader::read_exact(void *dst, size_t n) {
+        if (read(dst, n) != n) throw std::ios_base::failure("Unexpected end of input");
+    }
+
+    ByteWriter::ByteWriter(std::streambuf *target, size_t buffer_size) : dst(target), storage(buffer_size) {
+        buf = storage.data();
+        capacity = storage.size();
+    }
+
+    ByteWriter::ByteWriter(uint8_t *data, size_t size) : buf(data), capacity(size) {}
+
+    ByteWriter::ByteWriter(std::vector<uint8_t> &target) : sink(&target) {
+        sink->resize(sink->capacity());
+        buf = sink->data();
+        capacity = sink->size();
+    }
+
+    void ByteWriter::write_slow(const void *src, size_t n) {
+        while (n != 0) {
+            if (used == capacity) spill();
+            size_t part = std::min(n, capacity - used);
+            std::memcpy(buf + used, src, part);
+            used += part;
+            src = (const uint8_t *)src + part;
+            n -= part;
+        }
+    }
+
+    void ByteWriter::fill(uint8_t byte, uint64_t n) {
+        while (n != 0) {
+            if (used == capacity) spill();
+            size_t part = (size_t)std::min<uint64_t>(n, capacity - used);
+            std::memset(buf + used, byte, part);
+            used += part;
+            n -= part;
+        }
+    }
+
+    void ByteWriter::spill() {
+        if (sink != nullptr) {
+            sink->resize(std::max<size_t>(2 * capacity, 1 << 12));
+            buf = sink->data();
+            capacity = sink->size();
+            return;
+        }
+        if (dst == nullptr) throw std::ios_base::failure("Output buffer is full");
+        flush();
+    }
+
+    size_t varint_size(uint64_t value) {
+        size_t size = 1;
+        for (; value >= 0x80; value >>= 7) size++;
+        return size;
+    }
+
+    void write_varint(ByteWriter &out, uint64_t value) {
+        uint8_t bytes[max_varint_size];
+        size_t size = 0;
+        for (; value >= 0x80; value >>= 7) bytes[size++] = uint8_t(value | 0x80);
+        bytes[size++] = uint8_t(value);
+        out.write(bytes, size);
+    }
+
+    uint64_t read_varint(ByteReader &in) {
+        uint64_t value = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+            uint8_t byte;
+            in.read_exact(&byte, sizeof(uint8_t));
+            if (shift == 63 && byte > 1) break;
+            value |= uint64_t(byte & 0x7f) << shift;
+            if (!(byte & 0x80)) return value;
+        }
+        throw std::ios_base::failure("Invalid varint");
+    }
+
+    void ByteWriter::flush() {
+        if (sink != nullptr) {
+            sink->resize(used);
+            buf = sink->data();
+            capacity = used;
+            return;
+        }
+        if (dst == nullptr || used == 0) return;
+        ScopedTimer timer(waited);
+        if (dst->sputn((const char *)buf, (std::streamsize)used) != (std::streamsize)used) {
+            throw std::ios_base::failure("Unable to write output");
+        }
+        flushed += used;
+        used = 0;
+    }
+
+}
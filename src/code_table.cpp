@@ -0,0 +1,283 @@
+#include "code_table.h"
+#include <algorithm>
+#include <numeric>
+#include <ios>
+#include <climits>
+#include <stdexcept>
+
+namespace huffman {
+
+    static constexpr size_t sparse_limit = 32;
+    static constexpr uint8_t dense_flag = 1;
+    static constexpr uint8_t nibble_flag = 2;
+    static constexpr size_t max_alphabet = 1 << CHAR_BIT;
+
+    std::vector<uint64_t> canonical_codes(const std::vector<uint8_t> &lengths) {
+        std::vector<uint64_t> codes;
+        canonical_codes(lengths, codes);
+        return codes;
+    }
+
+    // Codes of every length are consecutive and start right after the last code of the previous length, shifted.
+    void canonical_codes(const std::vector<uint8_t> &lengths, std::vector<uint64_t> &codes) {
+        uint32_t count[UINT8_MAX + 1] = {};
+        uint64_t next[UINT8_MAX + 1] = {};
+        for (uint8_t len : lengths) count[len]++;
+        count[0] = 0;
+        for (int len = 1; len <= UINT8_MAX; len++) next[len] = (next[len - 1] + count[len - 1]) << 1;
+        codes.assign(lengths.size(), 0);
+        for (size_t symbol = 0; symbol < lengths.size(); symbol++) {
+            if (lengths[symbol] != 0) codes[symbol] = next[lengths[symbol]]++;
+        }
+    }
+
+    std::vector<uint8_t> package_merge(const std::vector<uint64_t> &freq, int max_length) {
+        std::vector<uint8_t> lengths;
+        MergeScratch scratch;
+        package_merge(freq, max_length, lengths, scratch);
+        return lengths;
+    }
+
+    void package_merge(const std::vector<uint64_t> &freq, int max_length, std::vector<uint8_t> &lengths, MergeScratch &scratch) {
+        std::vector<uint32_t> &leaves = scratch.leaves;
+        lengths.assign(freq.size(), 0);
+        leaves.clear();
+        for (uint32_t ch = 0; ch < freq.size(); ch++) {
+            if (freq[ch] != 0) leaves.push_back(ch);
+        }
+        if (leaves.size() == 1) lengths[leaves[0]] = 1;
+        if (leaves.size() < 2) return;
+        std::sort(leaves.begin(), leaves.end(), [&freq](uint32_t a, uint32_t b) {
+            return freq[a] < freq[b] || (freq[a] == freq[b] && a < b);
+        });
+
+        // Every level is the merge of the leaves with the pairs of the previous level, only the kind of each
+        // item is remembered: taking a prefix of a level takes a prefix of the leaves and a prefix of the packages.
+        // A level holds fewer than twice as many items as there are leaves.
+        size_t stride = 2 * leaves.size();
+        std::vector<bool> &is_leaf = scratch.is_leaf;
+        std::vector<uint64_t> &prev = scratch.prev, &cur = scratch.cur;
+        is_leaf.assign(max_length * stride, false);
+        prev.clear();
+        for (int level = 0; level < max_length; level++) {
+            cur.clear();
+            size_t i = 0, j = 0, item = level * stride;
+            while (i < leaves.size() || j + 1 < prev.size()) {
+                if (j + 1 >= prev.size() || (i < leaves.size() && freq[leaves[i]] <= prev[j] + prev[j + 1])) {
+                    cur.push_back(freq[leaves[i++]]);
+                    is_leaf[item++] = true;
+                } else {
+                    cur.push_back(prev[j] + prev[j + 1]);
+                    item++;
+                    j += 2;
+                }
+            }
+            std::swap(prev, cur);
+        }
+        size_t taken = 2 * leaves.size() - 2;
+        for (int level = max_length - 1; level >= 0 && taken != 0; level--) {
+            size_t packages = 0, leaf = 0;
+            for (size_t i = 0; i < taken; i++) {
+                if (is_leaf[level * stride + i]) {
+                    lengths[leaves[leaf++]]++;
+                } else {
+                    packages++;
+                }
+            }
+            taken = 2 * packages;
+        }
+    }
+
+    // Apart from the single symbol case the lengths must describe a complete prefix code.
+    static bool complete_code(const std::vector<uint8_t> &lengths, size_t present) {
+        if (present < 2) return true;
+        uint64_t kraft = 0;
+        for (uint8_t len : lengths) {
+            if (len != 0) kraft += uint64_t(1) << (63 - len);
+        }
+        return kraft == uint64_t(1) << 63;
+    }
+
+    void write_code_lengths(ByteWriter &out, const std::vector<uint8_t> &lengths) {
+        if (lengths.size() > max_alphabet) throw std::invalid_argument("Invalid alphabet size!");
+        uint8_t present[max_alphabet], packed[max_alphabet], bitmap[max_alphabet / CHAR_BIT] = {};
+        uint8_t flags = 0;
+        uint16_t size = 0;
+        for (size_t ch = 0; ch < lengths.size(); ch++) {
+            if (lengths[ch] != 0) present[size++] = ch;
+        }
+        out.write(&size, sizeof(uint16_t));
+        if (size == 0) return;
+        if (size > sparse_limit) flags |= dense_flag;
+        if (*std::max_element(lengths.begin(), lengths.end()) <= 0xF) flags |= nibble_flag;
+        out.write(&flags, sizeof(uint8_t));
+        if (flags & dense_flag) {
+            for (size_t i = 0; i < size; i++) bitmap[present[i] / 8] |= 1 << (present[i] % 8);
+            out.write(bitmap, (lengths.size() + 7) / 8);
+        } else {
+            out.write(present, size);
+        }
+        size_t packed_size = 0;
+        for (size_t i = 0; i < size; i++) {
+            uint8_t len = lengths[present[i]];
+            if (!(flags & nibble_flag)) {
+                packed[packed_size++] = len;
+            } else if (i % 2 == 0) {
+                packed[packed_size++] = len << 4;
+            } else {
+                packed[packed_size - 1] |= len;
+            }
+        }
+        out.write(packed, packed_size);
+    }
+
+    std::vector<uint8_t> read_code_lengths(ByteReader &in, size_t alphabet) {
+        std::vector<uint8_t> lengths;
+        read_code_lengths(in, alphabet, lengths);
+        return lengths;
+    }
+
+    void read_code_lengths(ByteReader &in, size_t alphabet, std::vector<uint8_t> &lengths) {
+        if (alphabet > max_alphabet) throw std::invalid_argument("Invalid alphabet size!");
+        lengths.assign(alphabet, 0);
+        uint16_t size;
+        in.read_exact(&size, sizeof(uint16_t));
+        if (size == 0) return;
+        if (size > alphabet) throw std::ios_base::failure("Invalid code lengths");
+        uint8_t flags;
+        in.read_exact(&flags, sizeof(uint8_t));
+        uint8_t present[max_alphabet], packed[max_alphabet];
+        if (flags & dense_flag) {
+            uint8_t bitmap[max_alphabet / CHAR_BIT];
+            in.read_exact(bitmap, (alphabet + 7) / 8);
+            size_t found = 0;
+            for (size_t ch = 0; ch < alphabet; ch++) {
+                if (!(bitmap[ch / 8] & (1 << (ch % 8)))) continue;
+                if (found == size) throw std::ios_base::failure("Invalid code lengths");
+                present[found++] = ch;
+            }
+            if (found != size) throw std::ios_base::failure("Invalid code lengths");
+        } else {
+            in.read_exact(present, size);
+        }
+        in.read_exact(packed, (flags & nibble_flag) ? (size + 1) / 2 : size);
+        for (size_t i = 0; i < size; i++) {
+            uint8_t len = (flags & nibble_flag) ? (packed[i / 2] >> ((i % 2) ? 0 : 4)) & 0xF : packed[i];
+            if (len == 0 || len > 63 || lengths[present[i]] != 0) throw std::ios_base::failure("Invalid code lengths");
+            lengths[present[i]] = len;
+        }
+        if (!complete_code(lengths, size)) throw std::ios_base::failure("Invalid code lengths");
+    }
+
+    void write_dense_lengths(ByteWriter &out, const std::vector<uint8_t> &lengths) {
+        uint8_t flags = dense_flag;
+        if (*std::max_element(lengths.begin(), lengths.end()) <= 0xF) flags |= nibble_flag;
+        out.put(flags);
+        if (!(flags & nibble_flag)) {
+            out.write(lengths.data(), lengths.size());
+            return;
+        }
+        for (size_t i = 0; i < lengths.size(); i += 2) {
+            out.put(lengths[i] << 4 | (i + 1 < lengths.size() ? lengths[i + 1] : 0));
+        }
+    }
+
+    void read_dense_lengths(ByteReader &in, size_t alphabet, std::vector<uint8_t> &lengths) {
+        uint8_t flags;
+        in.read_exact(&flags, sizeof(uint8_t));
+        if (!(flags & dense_flag)) throw std::ios_base::failure("Invalid code lengths");
+        lengths.resize(alphabet);
+        if (flags & nibble_flag) {
+            // Unpacked from the back so that the packed bytes can share the vector with the lengths.
+            size_t packed = (alphabet + 1) / 2;
+            in.read_exact(lengths.data(), packed);
+            for (size_t i = alphabet; i-- > 0;) {
+                lengths[i] = (lengths[i / 2] >> ((i % 2) ? 0 : 4)) & 0xF;
+            }
+        } else {
+            in.read_exact(lengths.data(), alphabet);
+        }
+        for (uint8_t len : lengths) {
+            if (len == 0 || len > 63) throw std::ios_base::failure("Invalid code lengths");
+        }
+        if (!complete_code(lengths, alphabet)) throw std::ios_base::failure("Invalid code lengths");
+    }
+
+    static uint32_t leaf_entry(uint32_t symbol, uint32_t length) {
+        return (symbol << 8) | length;
+    }
+
+    static uint32_t link_entry(uint32_t offset, uint32_t sub_bits) {
+        return (offset << 8) | DecodeTable::link_flag | sub_bits;
+    }
+
+    DecodeTable::DecodeTable(const std::vector<uint8_t> &lengths) {
+        build(lengths);
+    }
+
+    void DecodeTable::build(const std::vector<uint8_t> &lengths, int root) {
+        std::fill_n(first_code, max_length + 1, 0);
+        std::fill_n(first_index, max_length + 1, 0);
+        std::fill_n(count, max_length + 1, 0);
+        longest = 0;
+        canonical_codes(lengths, codes);
+        for (uint32_t symbol = 0; symbol < lengths.size(); symbol++) {
+            count[lengths[symbol]]++;
+            longest = std::max(longest, (int)lengths[symbol]);
+        }
+        count[0] = 0;
+        for (int len = 1; len <= longest; len++) {
+            first_code[len] = (first_code[len - 1] + count[len - 1]) << 1;
+            first_index[len] = first_index[len - 1] + count[len - 1];
+        }
+        sorted.resize(first_index[longest] + count[longest]);
+        uint32_t next[max_length + 1];
+        std::copy_n(first_index, longest + 1, next);
+        for (uint32_t symbol = 0; symbol < lengths.size(); symbol++) {
+            if (lengths[symbol] != 0) sorted[next[lengths[symbol]]++] = symbol;
+        }
+
+        entries.assign(1 << root, 0);
+        uint8_t group[1 << root_bits] = {};
+        for (uint32_t symbol = 0; symbol < lengths.size(); symbol++) {
+            int len = lengths[symbol];
+            if (len == 0) continue;
+            if (len <= root) {
+                uint32_t first = codes[symbol] << (root - len);
+                std::fill_n(entries.begin() + first, 1 << (root - len), leaf_entry(symbol, len));
+            } else {
+                uint32_t prefix = codes[symbol] >> (len - root);
+                group[prefix] = std::max<int>(group[prefix], len);
+            }
+        }
+        for (uint32_t prefix = 0; prefix < (1u << root); prefix++) {
+            int sub_bits = group[prefix] - root;
+            if (sub_bits <= 0 || sub_bits > max_sub_bits) continue;
+            entries[prefix] = link_entry(entries.size(), sub_bits);
+            entries.resize(entries.size() + (1 << sub_bits), 0);
+        }
+        for (uint32_t symbol = 0; symbol < lengths.size(); symbol++) {
+            int len = lengths[symbol];
+            if (len <= root) continue;
+            uint32_t link = entries[codes[symbol] >> (len - root)];
+            if (!is_link(link)) continue;
+            int extra = len - root;
+            int sub_bits = length(link);
+            uint32_t first = (codes[symbol] & ((uint64_t(1) << extra) - 1)) << (sub_bits - extra);
+            std::fill_n(entries.begin() + value(link) + first, 1 << (sub_bits - extra), leaf_entry(symbol, extra));
+        }
+    }
+
+    uint32_t DecodeTable::decode_slow(uint64_t window, int available, uint32_t &symbol) const {
+        uint64_t code = 0;
+        for (int len = 1; len <= longest && len <= available; len++) {
+            code = (code << 1) | ((window >> (64 - len)) & 1);
+            if (code - first_code[len] < count[len]) {
+                symbol = sorted[first_index[len] + (code - first_code[len])];
+                return len;
+            }
+        }
+        return 0;
+    }
+
+}
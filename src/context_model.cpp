@@ -0,0 +1,95 @@
+#include "context_model.h"
+#include <cmath>
+#include <climits>
+#include <algorithm>
+
+namespace huffman {
+
+    static constexpr size_t alphabet = 1 << CHAR_BIT;
+
+    // Assignment rounds of the clustering, later rounds rarely move a context.
+    static constexpr int rounds = 3;
+
+    // K-means over distributions: the most frequent contexts seed the clusters, then every round moves each context
+    // to the cluster whose distribution codes it in the fewest bits and recounts the clusters. Only the bytes that
+    // follow a context are visited, so sparse text contexts are cheap.
+    size_t cluster_contexts(const std::vector<uint32_t> &pairs, size_t max_clusters, std::vector<uint8_t> &contexts,
+                            std::vector<uint64_t> &freq, ClusterScratch &scratch) {
+        std::vector<uint32_t> &symbols = scratch.symbols, &counts = scratch.counts, &starts = scratch.starts;
+        std::vector<uint32_t> &order = scratch.order;
+        std::vector<uint64_t> &totals = scratch.totals;
+        std::vector<float> &costs = scratch.costs;
+        symbols.clear();
+        counts.clear();
+        starts.clear();
+        order.clear();
+        totals.assign(alphabet, 0);
+        for (uint32_t ctx = 0; ctx < alphabet; ctx++) {
+            starts.push_back(symbols.size());
+            for (uint32_t ch = 0; ch < alphabet; ch++) {
+                uint32_t cnt = pairs[ctx << 8 | ch];
+                if (cnt == 0) continue;
+                symbols.push_back(ch);
+                counts.push_back(cnt);
+                totals[ctx] += cnt;
+            }
+            if (totals[ctx] != 0) order.push_back(ctx);
+        }
+        starts.push_back(symbols.size());
+        contexts.assign(alphabet, 0);
+        freq.clear();
+        if (order.empty()) return 0;
+
+        auto add_context = [&](uint32_t ctx, size_t cluster) {
+            for (uint32_t i = starts[ctx]; i < starts[ctx + 1]; i++) freq[cluster * alphabet + symbols[i]] += counts[i];
+        };
+        std::sort(order.begin(), order.end(), [&totals](uint32_t a, uint32_t b) {
+            return totals[a] > totals[b] || (totals[a] == totals[b] && a < b);
+        });
+        size_t clusters = std::min(max_clusters, order.size());
+        freq.assign(clusters * alphabet, 0);
+        for (size_t k = 0; k < clusters; k++) add_context(order[k], k);
+        for (int round = 0; round < rounds; round++) {
+            // Code length estimates, smoothed so that bytes a cluster has not seen yet stay possible.
+            costs.resize(clusters * alphabet);
+            for (size_t k = 0; k < clusters; k++) {
+                uint64_t total = 0;
+                for (size_t ch = 0; ch < alphabet; ch++) total += freq[k * alphabet + ch];
+                float scale = std::log2((float)total + alphabet / 2);
+                for (size_t ch = 0; ch < alphabet; ch++) {
+                    costs[k * alphabet + ch] = scale - std::log2((float)freq[k * alphabet + ch] + 0.5f);
+                }
+            }
+            for (uint32_t ctx : order) {
+                float best = INFINITY;
+                for (size_t k = 0; k < clusters; k++) {
+                    const float *cost = costs.data() + k * alphabet;
+                    float bits = 0;
+                    for (uint32_t i = starts[ctx]; i < starts[ctx + 1]; i++) bits += counts[i] * cost[symbols[i]];
+                    if (bits < best) {
+                        best = bits;
+                        contexts[ctx] = k;
+                    }
+                }
+            }
+            freq.assign(clusters * alphabet, 0);
+            for (uint32_t ctx : order) add_context(ctx, contexts[ctx]);
+        }
+
+        // Clusters left without contexts are dropped and the rest renumbered in order.
+        uint8_t renumber[alphabet];
+        size_t used = 0;
+        for (size_t k = 0; k < clusters; k++) {
+            bool empty = std::all_of(freq.begin() + k * alphabet, freq.begin() + (k + 1) * alphabet, [](uint64_t cnt) {
+                return cnt == 0;
+            });
+            if (empty) continue;
+            std::copy_n(freq.begin() + k * alphabet, alphabet, freq.begin() + used * alphabet);
+            renumber[k] = used++;
+        }
+        freq.resize(used * alphabet);
+        for (size_t ctx = 0; ctx < alphabet; ctx++) contexts[ctx] = totals[ctx] != 0 ? renumber[contexts[ctx]] : 0;
+        return used;
+    }
+
+}
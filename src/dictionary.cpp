@@ -0,0 +1,118 @@
+#include "dictionary.h"
+#include <ios>
+#include <new>
+#include <cstring>
+#include <algorithm>
+#include <stdexcept>
+
+namespace huffman {
+
+    static constexpr uint8_t dictionary_magic[4] = {'H', 'D', 'I', 'C'};
+
+    // Fixed part of a dictionary image, the decode table entries follow it. Fields are in native byte order.
+    struct DictionaryHeader {
+        uint8_t magic[sizeof(dictionary_magic)];
+        uint32_t id;
+        uint32_t longest;
+        uint32_t entries;
+        uint8_t lengths[Dictionary::alphabet];
+        EncodeEntry codes[Dictionary::alphabet];
+    };
+
+    static_assert(sizeof(DictionaryHeader) % sizeof(uint32_t) == 0, "Decode entries must stay aligned");
+
+    static const DictionaryHeader & header_of(const uint8_t *image) {
+        return *reinterpret_cast<const DictionaryHeader *>(image);
+    }
+
+    // FNV-1a.
+    static uint32_t hash_lengths(const uint8_t *lengths) {
+        uint32_t hash = 2166136261u;
+        for (size_t ch = 0; ch < Dictionary::alphabet; ch++) hash = (hash ^ lengths[ch]) * 16777619u;
+        return hash;
+    }
+
+    // Every byte needs a code no longer than max_code_length and together the codes must be a complete prefix code.
+    static bool valid_lengths(const uint8_t *lengths) {
+        uint64_t kraft = 0;
+        for (size_t ch = 0; ch < Dictionary::alphabet; ch++) {
+            if (lengths[ch] == 0 || lengths[ch] > Dictionary::max_code_length) return false;
+            kraft += uint64_t(1) << (Dictionary::max_code_length - lengths[ch]);
+        }
+        return kraft == uint64_t(1) << Dictionary::max_code_length;
+    }
+
+    Dictionary Dictionary::build(const std::vector<uint8_t> &lengths) {
+        DecodeTable decode(lengths);
+        std::vector<uint64_t> codes = canonical_codes(lengths);
+        Dictionary dictionary;
+        dictionary.image_size = sizeof(DictionaryHeader) + decode.size() * sizeof(uint32_t);
+        dictionary.storage.assign(dictionary.image_size / sizeof(uint32_t), 0);
+        auto *header = new (dictionary.storage.data()) DictionaryHeader();
+        std::memcpy(header->magic, dictionary_magic, sizeof(dictionary_magic));
+        header->longest = decode.longest_code();
+        header->entries = decode.size();
+        for (size_t ch = 0; ch < alphabet; ch++) {
+            header->lengths[ch] = lengths[ch];
+            header->codes[ch].code = codes[ch];
+            header->codes[ch].length = lengths[ch];
+        }
+        header->id = hash_lengths(header->lengths);
+        std::memcpy(dictionary.storage.data() + sizeof(DictionaryHeader) / sizeof(uint32_t), decode.data(), decode.size() * sizeof(uint32_t));
+        dictionary.image = (const uint8_t *)dictionary.storage.data();
+        return dictionary;
+    }
+
+    Dictionary Dictionary::train(const std::vector<uint64_t> &freq, int max_length) {
+        if (freq.size() != alphabet) throw std::invalid_argument("Invalid alphabet size!");
+        if (max_length < min_code_length || max_length > max_code_length) throw std::invalid_argument("Invalid maximum code length!");
+        std::vector<uint64_t> counts(freq);
+        for (uint64_t &cnt : counts) cnt = std::max<uint64_t>(cnt, 1);
+        return build(package_merge(counts, max_length));
+    }
+
+    // The tables are compared with the ones built from the code lengths: the decoder follows the links of the mapped
+    // table without bounds checks, so a damaged file must not get through.
+    Dictionary Dictionary::load(const std::string &path) {
+        Dictionary dictionary;
+        dictionary.file = MappedFile::open_read(path);
+        const uint8_t *data = dictionary.file.data();
+        size_t size = dictionary.file.size();
+        if (size < sizeof(DictionaryHeader) || std::memcmp(data, dictionary_magic, sizeof(dictionary_magic)) != 0) {
+            throw std::ios_base::failure("Invalid dictionary");
+        }
+        const uint8_t *lengths = header_of(data).lengths;
+        if (!valid_lengths(lengths)) throw std::ios_base::failure("Invalid dictionary");
+        Dictionary expected = build(std::vector<uint8_t>(lengths, lengths + alphabet));
+        if (size != expected.image_size || std::memcmp(data, expected.image, size) != 0) {
+            throw std::ios_base::failure("Invalid dictionary");
+        }
+        dictionary.image = data;
+        dictionary.image_size = size;
+        return dictionary;
+    }
+
+    void Dictionary::save(const std::string &path) const {
+        MappedFile target = MappedFile::create(path, image_size);
+        std::memcpy(target.data(), image, image_size);
+        target.close(image_size);
+    }
+
+    uint32_t Dictionary::id() const {
+        return header_of(image).id;
+    }
+
+    const uint8_t * Dictionary::code_lengths() const {
+        return header_of(image).lengths;
+    }
+
+    const EncodeEntry * Dictionary::encode_table() const {
+        return header_of(image).codes;
+    }
+
+    DecodeView Dictionary::decode_table() const {
+        const DictionaryHeader &header = header_of(image);
+        return DecodeView((const uint32_t *)(image + sizeof(DictionaryHeader)), (int)header.longest);
+    }
+
+}
@@ -0,0 +1,73 @@
+#include "histogram.h"
+#include <cstring>
+#include <algorithm>
+
+namespace huffman {
+
+    // Consecutive bytes are counted in different banks, so a run of equal bytes does not serialize on the store to
+    // a single counter. Bank counters are 32-bit to keep all eight banks in L1, the input is therefore counted in
+    // chunks small enough for them not to overflow.
+    static constexpr int banks_count = 8;
+    static constexpr size_t chunk_size = size_t(1) << 30;
+
+    // Smallest slice worth a task of the parallel count.
+    static constexpr size_t min_slice_size = 1 << 16;
+
+    static inline void count_word(uint32_t (*banks)[256], uint32_t word) {
+        banks[0][uint8_t(word)]++;
+        banks[1][uint8_t(word >> 8)]++;
+        banks[2][uint8_t(word >> 16)]++;
+        banks[3][uint8_t(word >> 24)]++;
+    }
+
+    void count_frequencies(const uint8_t *data, size_t size, std::vector<uint64_t> &freq) {
+        uint32_t banks[banks_count][256];
+        while (size != 0) {
+            size_t part = std::min(size, chunk_size);
+            std::memset(banks, 0, sizeof(banks));
+            const uint8_t *end = data + (part & ~size_t(15));
+            for (; data != end; data += 16) {
+                uint64_t low, high;
+                std::memcpy(&low, data, sizeof(uint64_t));
+                std::memcpy(&high, data + 8, sizeof(uint64_t));
+                count_word(banks, uint32_t(low));
+                count_word(banks + 4, uint32_t(low >> 32));
+                count_word(banks, uint32_t(high));
+                count_word(banks + 4, uint32_t(high >> 32));
+            }
+            for (end = data + (part & 15); data != end; data++) banks[0][*data]++;
+            for (int ch = 0; ch < 256; ch++) {
+                uint32_t total = 0;
+                for (auto &bank : banks) total += bank[ch];
+                freq[ch] += total;
+            }
+            size -= part;
+        }
+    }
+
+    void count_frequencies(const uint8_t *data, size_t size, std::vector<uint64_t> &freq, ThreadPool &pool, int parts) {
+        size_t slices = std::max(parts, 1), slice = std::max(min_slice_size, (size + slices - 1) / slices);
+        std::vector<std::future<std::vector<uint64_t>>> counted;
+        for (size_t offset = 0; offset < size; offset += slice) {
+            size_t part = std::min(slice, size - offset);
+            counted.push_back(pool.submit([data = data + offset, part]() {
+                std::vector<uint64_t> local(256);
+                count_frequencies(data, part, local);
+                return local;
+            }));
+        }
+        for (auto &task : counted) {
+            std::vector<uint64_t> local = task.get();
+            for (int ch = 0; ch < 256; ch++) freq[ch] += local[ch];
+        }
+    }
+
+    void count_pairs(const uint8_t *data, size_t size, std::vector<uint32_t> &pairs) {
+        uint32_t prev = 0;
+        for (size_t i = 0; i < size; i++) {
+            pairs[prev << 8 | data[i]]++;
+            prev = data[i];
+        }
+    }
+
+}
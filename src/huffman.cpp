@@ -1,158 +1,1751 @@
 #include "huffman.h"
+#include "bit_io.h"
+#include "code_table.h"
+#include "byte_io.h"
+#include "mapped_file.h"
+#include "dictionary.h"
+#include "thread_pool.h"
+#include "histogram.h"
+#include "context_model.h"
+#include "token_model.h"
+#include "symbol_model.h"
+#include "timer.h"
 #include <fstream>
 #include <climits>
 #include <algorithm>
+#include <cstring>
+#include <deque>
+#include <future>
+#include <mutex>
+#include <filesystem>
+#include <type_traits>
 
 namespace huffman {
 
-    static void swap_min_with_last(std::vector<std::unique_ptr<TreeNode>> &nodes) {
-        std::iter_swap(nodes.end() - 1,
-                       std::min_element(nodes.begin(),
-                                        nodes.end(),
-                                        [](const std::unique_ptr<TreeNode> &a, const std::unique_ptr<TreeNode> &b) { return a->val <= b->val; }));
+    uint16_t HuffTree::add_node(const TreeNode &node) {
+        nodes.push_back(node);
+        return uint16_t(nodes.size() - 1);
     }
 
-    HuffTree::HuffTree(const std::vector<int> &freq) {
-        std::vector<std::unique_ptr<TreeNode>> nodes;
-        chars.resize(freq.size());
+    HuffTree::HuffTree(const std::vector<uint64_t> &freq) {
+        build(freq);
+    }
+
+    // Two-queue construction: leaves sorted by (count, symbol) form the first queue and merged nodes, which are
+    // created in non-decreasing order of their counts, form the second one. On equal counts a leaf is taken first.
+    // Children always precede their parent, so depths are assigned by walking the nodes back from the root.
+    void HuffTree::build(const std::vector<uint64_t> &freq) {
+        chars = freq;
+        nodes.clear();
+        root = TreeNode::none;
+        size = (int)std::count_if(freq.begin(), freq.end(), [](uint64_t cnt) { return cnt != 0; });
+        if (size == 0) return;
+        nodes.reserve(2 * size - 1);
         for (int ch = 0; ch < freq.size(); ch++) {
-            chars[ch] = freq[ch];
-            if (freq[ch] != 0) {
-                size++;
-                nodes.push_back(std::make_unique<TreeNode>(ch, freq[ch]));
+            if (freq[ch] != 0) add_node(TreeNode(char(ch), freq[ch]));
+        }
+        std::sort(nodes.begin(), nodes.end(), [](const TreeNode &a, const TreeNode &b) {
+            return a.val < b.val || (a.val == b.val && uint8_t(a.ch) < uint8_t(b.ch));
+        });
+
+        uint16_t next_leaf = 0, next_merged = size;
+        auto take_min = [&]() {
+            if (next_leaf < size && (next_merged == nodes.size() || nodes[next_leaf].val <= nodes[next_merged].val)) {
+                return next_leaf++;
+            }
+            return next_merged++;
+        };
+        while (nodes.size() < size_t(2 * size - 1)) {
+            uint16_t min1 = take_min();
+            uint16_t min2 = take_min();
+            add_node(TreeNode(min1, min2, nodes[min1].val + nodes[min2].val));
+        }
+        root = uint16_t(nodes.size() - 1);
+        for (int i = root; i >= size; i--) {
+            nodes[nodes[i].left].depth = nodes[nodes[i].right].depth = nodes[i].depth + 1;
+        }
+    }
+
+    HuffTree HuffTree::canonical(const std::vector<uint8_t> &lengths) {
+        HuffTree tree;
+        std::vector<uint64_t> codes = canonical_codes(lengths);
+        for (size_t ch = 0; ch < lengths.size(); ch++) {
+            if (lengths[ch] != 0) tree.size++;
+        }
+        tree.chars.resize(lengths.size());
+        if (tree.size == 0) return tree;
+        tree.nodes.reserve(2 * tree.size);
+        tree.root = tree.add_node(TreeNode());
+        for (size_t ch = 0; ch < lengths.size(); ch++) {
+            if (lengths[ch] == 0) continue;
+            if (tree.size == 1) {
+                tree.nodes[tree.root].ch = char(ch);
+                break;
             }
+            uint16_t cur = tree.root;
+            for (int i = lengths[ch] - 1; i >= 0; i--) {
+                bool bit = (codes[ch] >> i) & 1;
+                uint16_t next = bit ? tree.nodes[cur].right : tree.nodes[cur].left;
+                if (next == TreeNode::none) {
+                    next = tree.add_node(TreeNode());
+                    tree.nodes[next].depth = tree.nodes[cur].depth + 1;
+                    (bit ? tree.nodes[cur].right : tree.nodes[cur].left) = next;
+                }
+                cur = next;
+            }
+            tree.nodes[cur].ch = char(ch);
         }
+        return tree;
+    }
 
-        while (nodes.size() > 1) {
-            swap_min_with_last(nodes);
-            std::unique_ptr<TreeNode> min1 = std::move(nodes.back());
-            nodes.pop_back();
-            swap_min_with_last(nodes);
-            std::unique_ptr<TreeNode> min2 = std::move(nodes.back());
-            nodes.pop_back();
-            nodes.push_back(std::make_unique<TreeNode>(min1, min2));
+    // A lone leaf gets a one bit code.
+    std::vector<uint8_t> HuffTree::code_lengths() const {
+        std::vector<uint8_t> lengths(chars.size());
+        for (const TreeNode &node : nodes) {
+            if (node.is_leaf()) lengths[uint8_t(node.ch)] = std::max<uint8_t>(node.depth, 1);
         }
+        return lengths;
+    }
+
+    std::vector<uint8_t> HuffTree::code_lengths(int max_length) const {
+        std::vector<uint8_t> lengths;
+        MergeScratch scratch;
+        code_lengths(max_length, lengths, scratch);
+        return lengths;
+    }
 
-        root = (nodes.empty()) ? nullptr : std::move(nodes[0]);
+    void HuffTree::code_lengths(int max_length, std::vector<uint8_t> &lengths, MergeScratch &scratch) const {
+        lengths.assign(chars.size(), 0);
+        int longest = 0;
+        for (const TreeNode &node : nodes) {
+            if (!node.is_leaf()) continue;
+            lengths[uint8_t(node.ch)] = std::max<uint8_t>(node.depth, 1);
+            longest = std::max<int>(longest, node.depth);
+        }
+        if (longest <= max_length) return;
+        int required = 0;
+        while ((1 << required) < size) required++;
+        package_merge(chars, std::max(max_length, required), lengths, scratch);
     }
 
-    StatHandler HuffTree::decode(std::ifstream &in, std::ofstream &out, int cnt) const {
+    StatHandler HuffTree::decode_reference(ByteReader &in, ByteWriter &out, uint64_t cnt) const {
         StatHandler statistics;
-        statistics.additionalData = in.tellg();
-        TreeNode *cur = root.get();
-        if (cur == nullptr) return statistics;
-        if (cur->left == nullptr) {
-            while (cnt != 0) {
-                out.write((char *)&cur->ch, sizeof(char));
-                cnt--;
-            }
+        statistics.additionalData = in.position();
+        uint64_t written = out.position();
+        if (root == TreeNode::none) return statistics;
+        const TreeNode *cur = &nodes[root];
+        if (cur->is_leaf()) {
+            out.fill(cur->ch, cnt);
+            cnt = 0;
         }
         while (cnt != 0) {
             uint8_t byte;
-            in.read((char *)(&byte), sizeof(uint8_t));
+            in.read_exact(&byte, sizeof(uint8_t));
             for (int i = CHAR_BIT - 1; i >= 0 && cnt != 0; i--) {
-                cur = (byte & (1 << i)) ? cur->right.get() : cur->left.get();
-                if (cur->left == nullptr) {
-                    out.write((char *)&cur->ch, sizeof(char));
-                    cur = root.get();
+                cur = &nodes[(byte & (1 << i)) ? cur->right : cur->left];
+                if (cur->is_leaf()) {
+                    out.put(cur->ch);
+                    cur = &nodes[root];
                     cnt--;
                 }
             }
         }
-        statistics.inputData = in.tellg();
-        statistics.outputData = out.tellp();
-        statistics.inputData -= statistics.additionalData;
+        statistics.inputData = in.position() - statistics.additionalData;
+        statistics.outputData = out.position() - written;
         return statistics;
     }
 
-    void HuffTree::archive(std::ofstream &out) const {
-        out.write((char *)(&size), sizeof(uint16_t));
-        for (int ch = 0; ch < chars.size(); ch++) {
-            if (chars[ch] != 0) {
-                out.write((char *)&ch, sizeof(uint8_t));
-                out.write((char *)&chars[ch], sizeof(int));
+    void HuffTree::archive(ByteWriter &out) const {
+        archive(out, code_lengths());
+    }
+
+    void HuffTree::archive(ByteWriter &out, const std::vector<uint8_t> &lengths) const {
+        write_code_lengths(out, lengths);
+        if (root != TreeNode::none) write_varint(out, nodes[root].val);
+    }
+
+    static void read_header(ByteReader &in, uint64_t &cnt, std::vector<uint8_t> &lengths) {
+        read_code_lengths(in, 1 << CHAR_BIT, lengths);
+        cnt = 0;
+        if (std::any_of(lengths.begin(), lengths.end(), [](uint8_t len) { return len != 0; })) {
+            cnt = read_varint(in);
+        }
+    }
+
+    HuffTree HuffTree::extract(ByteReader &in, uint64_t &cnt) {
+        std::vector<uint8_t> lengths;
+        read_header(in, cnt, lengths);
+        return canonical(lengths);
+    }
+
+    void HuffmanArchiver::set_max_code_length(int length) {
+        if (length < 1 || length > max_supported_code_length) throw std::invalid_argument("Invalid maximum code length!");
+        max_code_length = length;
+    }
+
+    void HuffmanArchiver::set_buffer_size(size_t size) {
+        if (size < min_buffer_size || size > max_buffer_size) throw std::invalid_argument("Invalid buffer size!");
+        buffer_size = size;
+    }
+
+    void HuffmanArchiver::set_block_size(size_t size) {
+        if (size < min_block_size || size > max_block_size) throw std::invalid_argument("Invalid block size!");
+        block_size = size;
+    }
+
+    void HuffmanArchiver::set_streams(int count) {
+        if (count < 1 || count > max_streams) throw std::invalid_argument("Invalid number of streams!");
+        streams = count;
+    }
+
+    void HuffmanArchiver::set_threads(int count) {
+        if (count < 1 || count > max_threads) throw std::invalid_argument("Invalid number of threads!");
+        threads = count;
+    }
+
+    void HuffmanArchiver::set_adaptive(bool enabled) {
+        adaptive = enabled;
+    }
+
+    void HuffmanArchiver::set_contexts(bool enabled) {
+        contexts = enabled;
+    }
+
+    void HuffmanArchiver::set_tokens(bool enabled) {
+        tokens = enabled;
+    }
+
+    void HuffmanArchiver::set_symbol_width(int bytes) {
+        if (bytes != 1 && bytes != 2 && bytes != 4) throw std::invalid_argument("Invalid symbol width!");
+        symbol_width = bytes;
+    }
+
+    void HuffmanArchiver::set_index(bool enabled) {
+        indexed = enabled;
+    }
+
+    void HuffmanArchiver::set_dictionary(std::shared_ptr<const Dictionary> shared) {
+        dictionary = std::move(shared);
+    }
+
+    static void build_table(const std::vector<uint8_t> &lengths, std::vector<EncodeEntry> &table, std::vector<uint64_t> &codes) {
+        canonical_codes(lengths, codes);
+        table.assign(lengths.size(), EncodeEntry());
+        if (size_t(std::count(lengths.begin(), lengths.end(), 0)) + 1 == lengths.size()) return;
+        for (size_t ch = 0; ch < lengths.size(); ch++) {
+            table[ch] = {uint32_t(codes[ch]), lengths[ch]};
+        }
+    }
+
+    static constexpr size_t max_header_size = 2 + 1 + (1 << CHAR_BIT) / CHAR_BIT + (1 << CHAR_BIT) + max_varint_size;
+
+    // Largest block body a valid archive can contain, larger frame sizes are rejected before allocating.
+    static constexpr size_t max_body_size = 1 + max_header_size + (HuffmanArchiver::max_streams - 1) * max_varint_size
+            + HuffmanArchiver::max_block_size * HuffmanArchiver::max_supported_code_length / CHAR_BIT;
+
+    // Symbol i goes to sub-stream i % streams, each sub-stream is an independent MSB-first bitstream.
+    static void encode_symbols(ByteReader &in, std::vector<BitWriter> &out, const std::vector<EncodeEntry> &table) {
+        size_t streams = out.size(), j = 0;
+        while (in.fill()) {
+            const uint8_t *data = in.data();
+            size_t size = in.available();
+            for (size_t i = 0; i < size; i++) {
+                out[j].put(table[data[i]].code, table[data[i]].length);
+                if (++j == streams) j = 0;
+            }
+            in.skip(size);
+        }
+        for (BitWriter &bits : out) bits.finish();
+    }
+
+    static bool has_payload(const std::vector<uint8_t> &lengths) {
+        return size_t(std::count(lengths.begin(), lengths.end(), 0)) + 1 < lengths.size();
+    }
+
+    // Memory reused by the blocks one thread codes in turn: once the buffers have grown to what the blocks need,
+    // coding a block allocates nothing.
+    struct BlockScratch {
+        HuffTree tree;
+        MergeScratch merge;
+        std::vector<uint64_t> freq, codes;
+        std::vector<uint8_t> lengths, chunk;
+        std::vector<EncodeEntry> table;
+        DecodeTable decode_table;
+        std::vector<uint32_t> pairs;
+        ClusterScratch clusters;
+        std::vector<uint64_t> cluster_freq;
+        std::vector<uint8_t> contexts, cluster_lengths, context_header;
+        std::vector<EncodeEntry> context_table;
+        std::vector<DecodeTable> decode_tables;
+        std::vector<uint32_t> context_entries;
+        Tokens tokens;
+        LexiconScratch lexicon;
+        SymbolAlphabet<uint16_t> narrow;
+        SymbolAlphabet<uint32_t> wide;
+        std::vector<uint8_t> index_lengths, index_header, coded_alphabet;
+        std::vector<EncodeEntry> index_table;
+        std::vector<ByteReader> sources;
+        std::vector<BitReader> readers;
+        std::vector<ByteWriter> writers;
+        std::vector<BitWriter> bits;
+    };
+
+    // A block is stored as [body size][stream count][code lengths][symbol count][jump table][sub-streams], where
+    // the body size, the symbol count and the jump table entries are varints. A zero body size marks the end of
+    // the archive. Sub-stream sizes follow from the code lengths, so the header
+    // is built up front and the payload is encoded in place.
+    struct BlockPlan {
+        std::vector<uint64_t> freq;
+        std::vector<uint8_t> header;
+        std::vector<EncodeEntry> table;
+        std::vector<uint32_t> sizes;
+        std::vector<uint8_t> contexts;
+        std::vector<uint32_t> indices;
+        uint64_t payload_size = 0;
+        uint64_t position = 0;
+        PhaseTimes time;
+
+        uint64_t body_size() const {
+            return header.size() + payload_size;
+        }
+
+        uint64_t frame_size() const {
+            return varint_size(body_size()) + body_size();
+        }
+    };
+
+    // Blocks coded against a dictionary set this flag in the stream count and carry [uint32 dictionary id] in place
+    // of the code lengths, followed by the symbol count and the jump table as usual. Every byte has a code in
+    // a dictionary, so such blocks always have a jump table.
+    static constexpr uint8_t dictionary_flag = 0x80;
+
+    // Fills the rest of a plan, the plan's memory is reused and its timings are added to. Its freq must be set unless
+    // the block is coded against a dictionary.
+    static void plan_block(BlockPlan &plan, const uint8_t *data, size_t size, int max_code_length, int streams,
+                           const Dictionary *dictionary, BlockScratch &scratch) {
+        std::vector<uint8_t> &lengths = scratch.lengths;
+        ByteWriter header(plan.header);
+        bool payload = true;
+        plan.contexts.clear();
+        plan.indices.clear();
+        if (dictionary != nullptr) {
+            header.put(dictionary_flag | streams);
+            uint32_t id = dictionary->id();
+            header.write(&id, sizeof(uint32_t));
+            write_varint(header, size);
+            ScopedTimer timer(plan.time.table);
+            plan.table.assign(dictionary->encode_table(), dictionary->encode_table() + Dictionary::alphabet);
+        } else {
+            header.put(streams);
+            {
+                ScopedTimer timer(plan.time.tree);
+                scratch.tree.build(plan.freq);
+                scratch.tree.code_lengths(max_code_length, lengths, scratch.merge);
+                scratch.tree.archive(header, lengths);
+            }
+            ScopedTimer timer(plan.time.table);
+            build_table(lengths, plan.table, scratch.codes);
+            payload = has_payload(lengths);
+        }
+        plan.sizes.clear();
+        plan.payload_size = 0;
+        {
+            // Sizing the sub-streams takes a pass over the data, so it is counted as coding.
+            ScopedTimer timer(plan.time.coding);
+            uint64_t stream_bits[HuffmanArchiver::max_streams] = {};
+            if (streams == 1 && dictionary == nullptr) {
+                for (size_t ch = 0; ch < plan.freq.size(); ch++) stream_bits[0] += plan.freq[ch] * plan.table[ch].length;
+            } else {
+                for (size_t i = 0, j = 0; i < size; i++) {
+                    stream_bits[j] += plan.table[data[i]].length;
+                    if (++j == (size_t)streams) j = 0;
+                }
+            }
+            for (int j = 0; j < streams; j++) {
+                plan.sizes.push_back((uint32_t)((stream_bits[j] + 7) / 8));
+                plan.payload_size += plan.sizes.back();
+            }
+        }
+        if (payload) {
+            for (int j = 0; j + 1 < streams; j++) write_varint(header, plan.sizes[j]);
+        }
+        header.flush();
+    }
+
+    // Blocks coded with order-1 contexts set this flag in the stream count and store, in place of the code lengths,
+    // [cluster count][cluster of every context, in nibbles][code lengths of every cluster], followed by the symbol
+    // count and the jump table as usual. The code of a symbol is taken from the cluster of the byte before it, the
+    // first byte of a block follows a zero.
+    static constexpr uint8_t context_flag = 0x40;
+    static constexpr size_t max_clusters = 16;
+
+    // Bytes of a block per context cluster, small blocks get fewer clusters to keep their tables small.
+    static constexpr size_t cluster_size = 1 << 12;
+
+    static constexpr size_t context_map_size = (1 << CHAR_BIT) / 2;
+
+    // Plans the block with order-1 contexts as well and takes that over if the block gets smaller.
+    static void plan_contexts(BlockPlan &plan, const uint8_t *data, size_t size, int max_code_length, int streams, BlockScratch &scratch) {
+        const size_t alphabet = 1 << CHAR_BIT;
+        std::vector<uint8_t> &contexts = scratch.contexts, &lengths = scratch.cluster_lengths;
+        std::vector<uint64_t> &freq = scratch.cluster_freq;
+        std::vector<EncodeEntry> &table = scratch.context_table;
+        {
+            ScopedTimer timer(plan.time.histogram);
+            scratch.pairs.assign(alphabet * alphabet, 0);
+            count_pairs(data, size, scratch.pairs);
+        }
+        ByteWriter header(scratch.context_header);
+        size_t clusters;
+        uint64_t bits = 0;
+        {
+            ScopedTimer timer(plan.time.tree);
+            clusters = cluster_contexts(scratch.pairs, std::min(max_clusters, 1 + size / cluster_size), contexts, freq, scratch.clusters);
+            if (clusters < 2) return;
+            header.put(context_flag | streams);
+            header.put(clusters);
+            uint8_t packed[context_map_size];
+            for (size_t ctx = 0; ctx < context_map_size; ctx++) packed[ctx] = contexts[2 * ctx] << 4 | contexts[2 * ctx + 1];
+            header.write(packed, context_map_size);
+            lengths.resize(clusters * alphabet);
+            for (size_t k = 0; k < clusters; k++) {
+                scratch.freq.assign(freq.begin() + k * alphabet, freq.begin() + (k + 1) * alphabet);
+                scratch.tree.build(scratch.freq);
+                scratch.tree.code_lengths(max_code_length, scratch.lengths, scratch.merge);
+                write_code_lengths(header, scratch.lengths);
+                std::copy(scratch.lengths.begin(), scratch.lengths.end(), lengths.begin() + k * alphabet);
+                for (size_t ch = 0; ch < alphabet; ch++) bits += freq[k * alphabet + ch] * scratch.lengths[ch];
+            }
+            write_varint(header, size);
+        }
+        // The sub-stream sizes take a pass over the data, which is not worth it if the estimate already loses.
+        if (header.position() + (bits + 7) / 8 >= plan.body_size()) return;
+        {
+            // Clusters with a single byte still get a one bit code, unlike blocks of a single byte.
+            ScopedTimer timer(plan.time.table);
+            table.resize(clusters * alphabet);
+            for (size_t k = 0; k < clusters; k++) {
+                scratch.lengths.assign(lengths.begin() + k * alphabet, lengths.begin() + (k + 1) * alphabet);
+                canonical_codes(scratch.lengths, scratch.codes);
+                for (size_t ch = 0; ch < alphabet; ch++) table[k * alphabet + ch] = {uint32_t(scratch.codes[ch]), scratch.lengths[ch]};
+            }
+        }
+        uint32_t sizes[HuffmanArchiver::max_streams];
+        uint64_t payload_size = 0;
+        {
+            ScopedTimer timer(plan.time.coding);
+            uint64_t stream_bits[HuffmanArchiver::max_streams] = {};
+            uint8_t prev = 0;
+            for (size_t i = 0, j = 0; i < size; i++) {
+                stream_bits[j] += table[contexts[prev] << CHAR_BIT | data[i]].length;
+                prev = data[i];
+                if (++j == (size_t)streams) j = 0;
+            }
+            for (int j = 0; j < streams; j++) {
+                sizes[j] = (uint32_t)((stream_bits[j] + 7) / 8);
+                payload_size += sizes[j];
+            }
+        }
+        for (int j = 0; j + 1 < streams; j++) write_varint(header, sizes[j]);
+        header.flush();
+        if (scratch.context_header.size() + payload_size >= plan.body_size()) return;
+        std::swap(plan.header, scratch.context_header);
+        std::swap(plan.table, table);
+        plan.sizes.assign(sizes, sizes + streams);
+        plan.payload_size = payload_size;
+        plan.contexts.assign(contexts.begin(), contexts.end());
+    }
+
+    // Like encode_symbols, with the code of every symbol taken from the cluster of the byte before it.
+    static void encode_contexts(const uint8_t *data, size_t size, std::vector<BitWriter> &out, const EncodeEntry *table, const uint8_t *contexts) {
+        size_t streams = out.size(), j = 0;
+        uint8_t prev = 0;
+        for (size_t i = 0; i < size; i++) {
+            const EncodeEntry &entry = table[contexts[prev] << CHAR_BIT | data[i]];
+            out[j].put(entry.code, entry.length);
+            prev = data[i];
+            if (++j == streams) j = 0;
+        }
+        for (BitWriter &bits : out) bits.finish();
+    }
+
+    // Token and wide symbol blocks code every symbol as its index in an alphabet of their own, which may need codes
+    // longer than the configured limit. Returns the payload size in bits.
+    static uint64_t index_code_lengths(const std::vector<uint64_t> &counts, int max_code_length, std::vector<uint8_t> &lengths, MergeScratch &merge) {
+        int max_length = max_code_length;
+        while ((size_t(1) << max_length) < counts.size()) max_length++;
+        package_merge(counts, max_length, lengths, merge);
+        uint64_t bits = 0;
+        for (size_t id = 0; id < counts.size(); id++) bits += counts[id] * lengths[id];
+        return bits;
+    }
+
+    // Finishes the plan of a block coded as alphabet indices: header holds everything before the jump table and
+    // scratch.index_lengths the code lengths, which take bits for the payload. The plan is taken over if the block
+    // gets smaller, ids then move into it for encode_block.
+    static void plan_indices(BlockPlan &plan, ByteWriter &header, uint64_t bits, std::vector<uint32_t> &ids, int streams, BlockScratch &scratch) {
+        const std::vector<uint8_t> &lengths = scratch.index_lengths;
+        std::vector<EncodeEntry> &table = scratch.index_table;
+        if (header.position() + (bits + 7) / 8 >= plan.body_size()) return;
+        {
+            ScopedTimer timer(plan.time.table);
+            canonical_codes(lengths, scratch.codes);
+            table.resize(lengths.size());
+            for (size_t id = 0; id < lengths.size(); id++) table[id] = {uint32_t(scratch.codes[id]), lengths[id]};
+        }
+        uint32_t sizes[HuffmanArchiver::max_streams];
+        uint64_t payload_size = 0;
+        {
+            ScopedTimer timer(plan.time.coding);
+            uint64_t stream_bits[HuffmanArchiver::max_streams] = {};
+            size_t j = 0;
+            for (uint32_t id : ids) {
+                stream_bits[j] += table[id].length;
+                if (++j == (size_t)streams) j = 0;
+            }
+            for (j = 0; j < (size_t)streams; j++) {
+                sizes[j] = (uint32_t)((stream_bits[j] + 7) / 8);
+                payload_size += sizes[j];
+            }
+        }
+        for (int j = 0; j + 1 < streams; j++) write_varint(header, sizes[j]);
+        header.flush();
+        if (scratch.index_header.size() + payload_size >= plan.body_size()) return;
+        std::swap(plan.header, scratch.index_header);
+        std::swap(plan.table, table);
+        std::swap(plan.indices, ids);
+        plan.sizes.assign(sizes, sizes + streams);
+        plan.payload_size = payload_size;
+        plan.contexts.clear();
+    }
+
+    // Blocks coded as tokens set this flag in the stream count and store, in place of the code lengths,
+    // [vocabulary size][lexicon byte size][lexicon][code lengths of the vocabulary][byte count][token count]
+    // [jump table], all sizes varints. Their symbols are vocabulary indices, the byte count is what the tokens expand
+    // to. The lexicon is decoded along with the payload, reading the header only skips it.
+    static constexpr uint8_t token_flag = 0x20;
+
+    // Bytes of a block per vocabulary entry it may take at most: blocks that split into barely repeated tokens, such
+    // as binary data, are given up on before sorting a vocabulary that could not pay for its lexicon.
+    static constexpr size_t vocabulary_ratio = 8;
+
+    // Plans the block as a sequence of tokens as well and takes that over if the block gets smaller.
+    static void plan_tokens(BlockPlan &plan, const uint8_t *data, size_t size, int max_code_length, int streams, BlockScratch &scratch) {
+        Tokens &tokens = scratch.tokens;
+        {
+            ScopedTimer timer(plan.time.histogram);
+            size_t limit = std::min(max_vocabulary, size / vocabulary_ratio + (1 << CHAR_BIT));
+            if (!tokenize(data, size, limit, tokens)) return;
+        }
+        ByteWriter header(scratch.index_header);
+        uint64_t bits;
+        {
+            ScopedTimer timer(plan.time.tree);
+            bits = index_code_lengths(tokens.counts, max_code_length, scratch.index_lengths, scratch.merge);
+            ByteWriter lexicon(scratch.coded_alphabet);
+            write_lexicon(lexicon, tokens.lexicon, scratch.lexicon);
+            lexicon.flush();
+            header.put(token_flag | streams);
+            write_varint(header, tokens.counts.size());
+            write_varint(header, scratch.coded_alphabet.size());
+            header.write(scratch.coded_alphabet.data(), scratch.coded_alphabet.size());
+            write_dense_lengths(header, scratch.index_lengths);
+            write_varint(header, size);
+            write_varint(header, tokens.ids.size());
+        }
+        plan_indices(plan, header, bits, tokens.ids, streams, scratch);
+    }
+
+    // Blocks of wide symbols set this flag in the stream count and store, in place of the code lengths,
+    // [symbol width][alphabet size][alphabet byte size][alphabet][code lengths of the alphabet][byte count]
+    // [bytes after the last whole symbol][jump table], all sizes varints. Their symbols are alphabet indices.
+    static constexpr uint8_t symbol_flag = 0x10;
+
+    // Symbols of a block per alphabet entry it may take at most: blocks of mostly distinct symbols, such as data of
+    // another width, are given up on before sorting an alphabet that could not pay for itself.
+    static constexpr size_t alphabet_ratio = 2;
+
+    // Plans the block as a sequence of symbols of type Symbol as well and takes that over if the block gets smaller.
+    template<class Symbol>
+    static void plan_symbols(BlockPlan &plan, const uint8_t *data, size_t size, int max_code_length, int streams,
+                             SymbolAlphabet<Symbol> &alphabet, BlockScratch &scratch) {
+        size_t count = size / sizeof(Symbol);
+        if (count == 0) return;
+        {
+            ScopedTimer timer(plan.time.histogram);
+            size_t limit = std::min(max_symbol_alphabet, count / alphabet_ratio + (1 << CHAR_BIT));
+            if (!count_symbols(data, count, limit, alphabet)) return;
+        }
+        ByteWriter header(scratch.index_header);
+        uint64_t bits;
+        {
+            ScopedTimer timer(plan.time.tree);
+            bits = index_code_lengths(alphabet.counts, max_code_length, scratch.index_lengths, scratch.merge);
+            ByteWriter symbols(scratch.coded_alphabet);
+            write_alphabet(symbols, alphabet.symbols);
+            symbols.flush();
+            header.put(symbol_flag | streams);
+            header.put(sizeof(Symbol));
+            write_varint(header, alphabet.symbols.size());
+            write_varint(header, scratch.coded_alphabet.size());
+            header.write(scratch.coded_alphabet.data(), scratch.coded_alphabet.size());
+            write_dense_lengths(header, scratch.index_lengths);
+            write_varint(header, size);
+            header.write(data + count * sizeof(Symbol), size % sizeof(Symbol));
+        }
+        plan_indices(plan, header, bits, alphabet.ids, streams, scratch);
+    }
+
+    // Tries every model enabled for a block after plan_block, each one is kept only if it beats the plan so far.
+    static void plan_models(BlockPlan &plan, const uint8_t *data, size_t size, int max_code_length, int streams, bool contexts,
+                            bool tokens, int symbol_width, BlockScratch &scratch) {
+        if (contexts) plan_contexts(plan, data, size, max_code_length, streams, scratch);
+        if (tokens) plan_tokens(plan, data, size, max_code_length, streams, scratch);
+        if (symbol_width == (int)sizeof(uint16_t)) plan_symbols(plan, data, size, max_code_length, streams, scratch.narrow, scratch);
+        if (symbol_width == (int)sizeof(uint32_t)) plan_symbols(plan, data, size, max_code_length, streams, scratch.wide, scratch);
+    }
+
+    // Like encode_symbols over alphabet indices.
+    static void encode_indices(const std::vector<uint32_t> &ids, std::vector<BitWriter> &out, const EncodeEntry *table) {
+        size_t streams = out.size(), j = 0;
+        for (uint32_t id : ids) {
+            out[j].put(table[id].code, table[id].length);
+            if (++j == streams) j = 0;
+        }
+        for (BitWriter &bits : out) bits.finish();
+    }
+
+    // Writes the whole frame of a block, dst must have room for plan.frame_size() bytes.
+    static void encode_block(const BlockPlan &plan, const uint8_t *data, size_t size, uint8_t *dst, BlockScratch &scratch) {
+        ByteWriter frame(dst, plan.frame_size());
+        write_varint(frame, plan.body_size());
+        frame.write(plan.header.data(), plan.header.size());
+        if (plan.payload_size == 0) return;
+        std::vector<ByteWriter> &writers = scratch.writers;
+        std::vector<BitWriter> &bits = scratch.bits;
+        bits.clear();
+        writers.clear();
+        writers.reserve(plan.sizes.size());
+        uint8_t *position = dst + frame.position();
+        for (uint32_t part : plan.sizes) {
+            bits.emplace_back(writers.emplace_back(position, part));
+            position += part;
+        }
+        if (!plan.contexts.empty()) {
+            encode_contexts(data, size, bits, plan.table.data(), plan.contexts.data());
+            return;
+        }
+        if (!plan.indices.empty()) {
+            encode_indices(plan.indices, bits, plan.table.data());
+            return;
+        }
+        ByteReader reader(data, size);
+        encode_symbols(reader, bits, plan.table);
+    }
+
+    // Output of a block task, how many of the block's archive bytes are framing and header and where the task spent
+    // its time.
+    struct CodedBlock {
+        std::vector<uint8_t> data;
+        size_t overhead = 0;
+        PhaseTimes time;
+    };
+
+    // Adaptive chunks are framed like blocks, [body size][0][symbol count][bitstream]: the zero in place of the
+    // stream count tells them apart from blocks that carry code lengths.
+    static constexpr uint8_t adaptive_marker = 0;
+
+    // Code shared by the adaptive encoder and decoder. Both start from flat counts and rebuild the code from all
+    // symbols seen so far after every chunk, so no code lengths are transmitted. Chunks start small for the code to
+    // adapt quickly and double up to max_chunk_size, counts are halved once the history grows past max_history.
+    class AdaptiveModel {
+    private:
+        std::vector<uint64_t> counts = std::vector<uint64_t>(1 << CHAR_BIT, 1);
+        std::vector<uint8_t> lengths = std::vector<uint8_t>(1 << CHAR_BIT, CHAR_BIT);
+        size_t chunk = first_chunk_size;
+        HuffTree tree;
+        MergeScratch merge;
+    public:
+        static constexpr size_t first_chunk_size = 1 << 7;
+        static constexpr size_t max_chunk_size = 1 << 16;
+        static constexpr uint64_t max_history = 1 << 20;
+
+        size_t chunk_size() const {
+            return chunk;
+        }
+
+        const std::vector<uint8_t> & code_lengths() const {
+            return lengths;
+        }
+
+        // Returns to the initial state, keeping the memory.
+        void reset() {
+            counts.assign(1 << CHAR_BIT, 1);
+            lengths.assign(1 << CHAR_BIT, CHAR_BIT);
+            chunk = first_chunk_size;
+        }
+
+        void update(const std::vector<uint64_t> &freq, PhaseTimes &time) {
+            ScopedTimer timer(time.tree);
+            uint64_t total = 0;
+            for (size_t ch = 0; ch < counts.size(); ch++) {
+                counts[ch] += freq[ch];
+                total += counts[ch];
+            }
+            if (total > max_history) {
+                for (uint64_t &cnt : counts) cnt = (cnt + 1) / 2;
             }
+            tree.build(counts);
+            tree.code_lengths(HuffmanArchiver::default_max_code_length, lengths, merge);
+            chunk = std::min(2 * chunk, max_chunk_size);
+        }
+    };
+
+    // Writes one adaptive chunk and returns the number of framing and header bytes.
+    static uint64_t encode_chunk(AdaptiveModel &model, const uint8_t *data, size_t size, ByteWriter &out, BlockScratch &scratch, PhaseTimes &time) {
+        std::vector<uint64_t> &freq = scratch.freq;
+        {
+            ScopedTimer timer(time.histogram);
+            freq.assign(1 << CHAR_BIT, 0);
+            count_frequencies(data, size, freq);
+        }
+        {
+            ScopedTimer timer(time.table);
+            build_table(model.code_lengths(), scratch.table, scratch.codes);
         }
+        // The bits go straight to the writer, which may flush to the stream. That wait is counted as io by the
+        // caller, so it is taken out of coding again.
+        uint64_t overhead, waited = out.wait_time();
+        {
+            ScopedTimer timer(time.coding);
+            uint64_t bits = 0;
+            for (size_t ch = 0; ch < freq.size(); ch++) bits += freq[ch] * scratch.table[ch].length;
+            uint64_t start = out.position();
+            write_varint(out, 1 + varint_size(size) + (bits + 7) / 8);
+            out.put(adaptive_marker);
+            write_varint(out, size);
+            overhead = out.position() - start;
+            ByteReader reader(data, size);
+            scratch.bits.clear();
+            scratch.bits.emplace_back(out);
+            encode_symbols(reader, scratch.bits, scratch.table);
+        }
+        time.coding -= out.wait_time() - waited;
+        model.update(freq, time);
+        return overhead;
+    }
+
+    // The optional index follows the end marker: the number of blocks and the raw and frame size of every block, all
+    // varints, then a fixed trailer [uint64 index size][magic] that is found from the end of the file. An archive
+    // without index ends with the zero end marker, which never matches the last byte of the magic.
+    static constexpr uint8_t index_magic[4] = {'H', 'I', 'D', 'X'};
+    static constexpr size_t index_trailer_size = sizeof(uint64_t) + sizeof(index_magic);
+
+    struct IndexEntry {
+        uint64_t raw_size = 0, frame_size = 0;
+    };
+
+    static void write_index(ByteWriter &out, const std::vector<IndexEntry> &entries) {
+        uint64_t start = out.position();
+        write_varint(out, entries.size());
+        for (const IndexEntry &entry : entries) {
+            write_varint(out, entry.raw_size);
+            write_varint(out, entry.frame_size);
+        }
+        uint64_t size = out.position() - start;
+        out.write(&size, sizeof(uint64_t));
+        out.write(index_magic, sizeof(index_magic));
     }
 
-    void HuffmanArchiver::build_table(TreeNode *root, std::vector<bool> &cur_code) {
-        if (root->left == nullptr) {
-            table[uint8_t(root->ch)] = cur_code;
+    // Returns false if the archive has no index, throws std::ios_base::failure if the index does not match the frames.
+    static bool read_index(const uint8_t *data, size_t size, std::vector<IndexEntry> &entries) {
+        if (size < index_trailer_size || std::memcmp(data + size - sizeof(index_magic), index_magic, sizeof(index_magic)) != 0) {
+            return false;
+        }
+        uint64_t index_size;
+        std::memcpy(&index_size, data + size - index_trailer_size, sizeof(uint64_t));
+        if (index_size > size - index_trailer_size) throw std::ifstream::failure("Invalid index");
+        uint64_t index_start = size - index_trailer_size - index_size, frames_size = varint_size(0);
+        ByteReader reader(data + index_start, index_size);
+        entries.resize(std::min<uint64_t>(read_varint(reader), index_size));
+        for (IndexEntry &entry : entries) {
+            entry.raw_size = read_varint(reader);
+            entry.frame_size = read_varint(reader);
+            if (frames_size > index_start || entry.frame_size > index_start - frames_size) {
+                throw std::ifstream::failure("Invalid index");
+            }
+            frames_size += entry.frame_size;
+        }
+        if (frames_size != index_start) throw std::ifstream::failure("Invalid index");
+        return true;
+    }
+
+    struct PayloadHeader {
+        std::vector<uint8_t> lengths;
+        std::vector<uint64_t> sizes;
+        uint64_t cnt = 0;
+        int streams = 1;
+        bool shared = false;
+        uint32_t dictionary = 0;
+        bool modeled = false;
+        size_t clusters = 0;
+        std::vector<uint8_t> contexts;
+        std::vector<std::vector<uint8_t>> cluster_lengths;
+        bool tokenized = false;
+        int width = 1;
+        uint64_t symbols = 0;
+        size_t alphabet_size = 0;
+        std::vector<uint8_t> alphabet, tail;
+    };
+
+    // Block whose header is parsed, offset is the position of its first byte in the decompressed data.
+    struct Frame {
+        PayloadHeader header;
+        const uint8_t *payload = nullptr;
+        size_t size = 0;
+        uint64_t offset = 0;
+        PhaseTimes time;
+    };
+
+    // Memory an archiver keeps between calls, along with its thread pool. The in-memory paths take all their buffers
+    // from here, so that once warmed up they allocate nothing when the pool has no workers.
+    struct Workspace {
+        BlockScratch scratch;
+        AdaptiveModel model;
+        std::vector<BlockPlan> plans;
+        std::vector<Frame> frames;
+        std::vector<IndexEntry> entries;
+        std::vector<uint8_t> index, archive;
+        std::unique_ptr<ThreadPool> pool;
+        int pool_threads = 0;
+
+        ThreadPool & thread_pool(int threads) {
+            if (pool == nullptr || pool_threads != threads) {
+                pool.reset();
+                pool = std::make_unique<ThreadPool>(threads);
+                pool_threads = threads;
+            }
+            return *pool;
+        }
+    };
+
+    HuffmanArchiver::HuffmanArchiver() : workspace(std::make_unique<Workspace>()) {}
+    HuffmanArchiver::HuffmanArchiver(HuffmanArchiver &&other) noexcept = default;
+    HuffmanArchiver & HuffmanArchiver::operator=(HuffmanArchiver &&other) noexcept = default;
+    HuffmanArchiver::~HuffmanArchiver() = default;
+
+    // Runs task(i, scratch) for every i below count. Without workers the tasks run inline on the given scratch memory,
+    // otherwise every task gets scratch memory of its own.
+    template<class Task>
+    static void for_each_block(ThreadPool &pool, size_t count, BlockScratch &scratch, const Task &task) {
+        if (pool.size() == 0) {
+            for (size_t i = 0; i < count; i++) task(i, scratch);
             return;
         }
-        cur_code.push_back(false);
-        build_table(root->left.get(), cur_code);
-        cur_code.pop_back();
-        cur_code.push_back(true);
-        build_table(root->right.get(), cur_code);
-        cur_code.pop_back();
+        pool.for_each(count, [&task](size_t i) {
+            BlockScratch local;
+            task(i, local);
+        });
     }
 
-    StatHandler HuffmanArchiver::zip(std::ifstream &in, std::ofstream &out) {
+    // Every chunk is passed on to the output stream, if there is one, as soon as it is coded. The byte counts of
+    // statistics must be zero, the timings are added to.
+    static void zip_adaptive(ByteReader &reader, ByteWriter &writer, std::ostream *out, StatHandler &statistics, Workspace &work) {
+        std::vector<uint8_t> &chunk = work.scratch.chunk;
+        work.model.reset();
+        while (true) {
+            chunk.resize(work.model.chunk_size());
+            size_t size = reader.read(chunk.data(), chunk.size());
+            if (size == 0) break;
+            statistics.additionalData += encode_chunk(work.model, chunk.data(), size, writer, work.scratch, statistics.time);
+            if (out != nullptr) {
+                writer.flush();
+                out->flush();
+            }
+        }
+        write_varint(writer, 0);
+        writer.flush();
+        statistics.inputData = reader.position();
+        statistics.additionalData += varint_size(0);
+        statistics.outputData = writer.position() - statistics.additionalData;
+        statistics.time.io += reader.wait_time() + writer.wait_time();
+    }
+
+    StatHandler HuffmanArchiver::zip(std::istream &in, std::ostream &out) {
+        if (adaptive && indexed) throw std::invalid_argument("Adaptive archives can not be indexed!");
+        if (adaptive && dictionary != nullptr) throw std::invalid_argument("Adaptive archives can not use a dictionary!");
+        if (adaptive && contexts) throw std::invalid_argument("Adaptive archives can not use contexts!");
+        if (adaptive && tokens) throw std::invalid_argument("Adaptive archives can not use tokens!");
+        if (adaptive && symbol_width != 1) throw std::invalid_argument("Adaptive archives can not use wide symbols!");
         StatHandler statistics;
-        std::vector<int> freq(1 << CHAR_BIT);
-        uint8_t ch;
-        in.seekg(0, std::ifstream::end);
-        int number_of_chars = in.tellg();
-        in.seekg(0, std::ifstream::beg);
-        for (int i = 0; i < number_of_chars; i++) {
-            in.read((char *)&ch, sizeof(uint8_t));
-            freq[ch]++;
-        }
-        tree = std::make_unique<HuffTree>(freq);
-        tree->archive(out);
-        statistics.additionalData = out.tellp();
-
-        in.seekg(0, std::ifstream::beg);
-        TreeNode *cur = tree->get_root();
-        std::vector<bool> cur_code;
-        cur_code.reserve(1 << CHAR_BIT);
-        if (cur != nullptr) {
-            table.resize(1 << CHAR_BIT);
-            build_table(cur, cur_code);
-        }
-        uint8_t tmp;
-        int cnt = 0;
-        for (int i = 0; i < number_of_chars; i++) {
-            in.read((char *)&ch, sizeof(uint8_t));
-            for (bool chr : table[ch]) {
-                cnt++;
-                tmp = 2 * tmp + chr;
-                if (cnt == CHAR_BIT) {
-                    out.write((char *)&tmp, sizeof(uint8_t));
-                    tmp = 0;
-                    cnt = 0;
+        ByteReader reader(in.rdbuf(), buffer_size);
+        ByteWriter writer(out.rdbuf(), buffer_size);
+        if (adaptive) {
+            zip_adaptive(reader, writer, &out, statistics, *workspace);
+            return statistics;
+        }
+        std::vector<IndexEntry> entries;
+        size_t written = 0;
+        ThreadPool &pool = workspace->thread_pool(threads);
+        std::deque<std::future<CodedBlock>> pending;
+        auto write_next = [&]() {
+            CodedBlock block = pending.front().get();
+            pending.pop_front();
+            writer.write(block.data.data(), block.data.size());
+            statistics.additionalData += block.overhead;
+            statistics.time += block.time;
+            entries[written++].frame_size = block.data.size();
+        };
+        while (true) {
+            std::vector<uint8_t> block(block_size);
+            size_t size = reader.read(block.data(), block.size());
+            if (size == 0) break;
+            block.resize(size);
+            statistics.inputData += size;
+            entries.push_back({size, 0});
+            pending.push_back(pool.submit([block = std::move(block), max_length = max_code_length, count = streams,
+                                           shared = dictionary.get(), modeled = contexts, tokenized = tokens, width = symbol_width]() {
+                BlockPlan plan;
+                BlockScratch scratch;
+                if (shared == nullptr) {
+                    ScopedTimer timer(plan.time.histogram);
+                    plan.freq.assign(1 << CHAR_BIT, 0);
+                    count_frequencies(block.data(), block.size(), plan.freq);
+                }
+                plan_block(plan, block.data(), block.size(), max_length, count, shared, scratch);
+                plan_models(plan, block.data(), block.size(), max_length, count, modeled, tokenized, width, scratch);
+                CodedBlock coded;
+                coded.overhead = plan.frame_size() - plan.payload_size;
+                {
+                    ScopedTimer timer(plan.time.coding);
+                    coded.data.resize(plan.frame_size());
+                    encode_block(plan, block.data(), block.size(), coded.data.data(), scratch);
                 }
+                coded.time = plan.time;
+                return coded;
+            }));
+            // Bounds the memory held by blocks that are read ahead or waiting to be written.
+            if (pending.size() >= 2 * (size_t)threads) write_next();
+        }
+        while (!pending.empty()) write_next();
+        write_varint(writer, 0);
+        statistics.additionalData += varint_size(0);
+        if (indexed) {
+            uint64_t start = writer.position();
+            write_index(writer, entries);
+            statistics.additionalData += writer.position() - start;
+        }
+        writer.flush();
+        statistics.outputData = writer.position() - statistics.additionalData;
+        statistics.time.io += reader.wait_time() + writer.wait_time();
+        return statistics;
+    }
+
+    StatHandler HuffmanArchiver::zip_memory(const uint8_t *data, size_t size, const Allocator &allocate) {
+        if (adaptive && indexed) throw std::invalid_argument("Adaptive archives can not be indexed!");
+        if (adaptive && dictionary != nullptr) throw std::invalid_argument("Adaptive archives can not use a dictionary!");
+        if (adaptive && contexts) throw std::invalid_argument("Adaptive archives can not use contexts!");
+        if (adaptive && tokens) throw std::invalid_argument("Adaptive archives can not use tokens!");
+        if (adaptive && symbol_width != 1) throw std::invalid_argument("Adaptive archives can not use wide symbols!");
+        StatHandler statistics;
+        Workspace &work = *workspace;
+        if (adaptive) {
+            // The archive size is only known once every chunk is coded.
+            ByteReader reader(data, size);
+            ByteWriter writer(work.archive);
+            zip_adaptive(reader, writer, nullptr, statistics, work);
+            std::memcpy(allocate(work.archive.size()), work.archive.data(), work.archive.size());
+            return statistics;
+        }
+        ThreadPool &pool = work.thread_pool(threads);
+        std::vector<BlockPlan> &plans = work.plans;
+        // Plans are never dropped, the ones beyond count keep their memory for longer inputs.
+        size_t count = (size + block_size - 1) / block_size;
+        if (plans.size() < count) plans.resize(count);
+        for (BlockPlan &plan : plans) plan.time = PhaseTimes();
+        // With fewer blocks than threads a block's histogram is split across the pool, otherwise every block is
+        // counted inside its own task. Blocks coded against a dictionary need no histogram.
+        const Dictionary *shared = dictionary.get();
+        bool split = shared == nullptr && count < (size_t)threads;
+        for (size_t i = 0; split && i < count; i++) {
+            ScopedTimer timer(statistics.time.histogram);
+            plans[i].freq.assign(1 << CHAR_BIT, 0);
+            count_frequencies(data + i * block_size, std::min(block_size, size - i * block_size), plans[i].freq, pool, threads);
+        }
+        for_each_block(pool, count, work.scratch, [&](size_t i, BlockScratch &scratch) {
+            size_t offset = i * block_size, part = std::min(block_size, size - offset);
+            BlockPlan &plan = plans[i];
+            if (shared == nullptr && !split) {
+                ScopedTimer timer(plan.time.histogram);
+                plan.freq.assign(1 << CHAR_BIT, 0);
+                count_frequencies(data + offset, part, plan.freq);
             }
+            plan_block(plan, data + offset, part, max_code_length, streams, shared, scratch);
+            plan_models(plan, data + offset, part, max_code_length, streams, contexts, tokens, symbol_width, scratch);
+        });
+
+        uint64_t total = 0;
+        std::vector<IndexEntry> &entries = work.entries;
+        entries.clear();
+        for (size_t i = 0; i < count; i++) {
+            plans[i].position = total;
+            total += plans[i].frame_size();
+            statistics.additionalData += plans[i].frame_size() - plans[i].payload_size;
+            entries.push_back({std::min<uint64_t>(block_size, size - i * block_size), plans[i].frame_size()});
+        }
+        std::vector<uint8_t> &index = work.index;
+        index.clear();
+        if (indexed) {
+            ByteWriter writer(index);
+            write_index(writer, entries);
+            writer.flush();
+        }
+
+        uint8_t *target = allocate(total + varint_size(0) + index.size());
+        for_each_block(pool, count, work.scratch, [&](size_t i, BlockScratch &scratch) {
+            size_t offset = i * block_size, part = std::min(block_size, size - offset);
+            ScopedTimer timer(plans[i].time.coding);
+            encode_block(plans[i], data + offset, part, target + plans[i].position, scratch);
+        });
+        for (size_t i = 0; i < count; i++) statistics.time += plans[i].time;
+        ByteWriter end(target + total, varint_size(0) + index.size());
+        write_varint(end, 0);
+        if (!index.empty()) end.write(index.data(), index.size());
+        statistics.inputData = size;
+        statistics.additionalData += varint_size(0);
+        statistics.outputData = total + varint_size(0) - statistics.additionalData;
+        statistics.additionalData += index.size();
+        return statistics;
+    }
+
+    StatHandler HuffmanArchiver::zip_file(const std::string &input, const std::string &output) {
+        uint64_t io = 0;
+        MappedFile source, target;
+        {
+            ScopedTimer timer(io);
+            source = MappedFile::open_read(input);
         }
-        bool flag = false;
-        while (cnt % 8 != 0) {
-            cnt++;
-            tmp *= 2;
-            flag = true;
+        StatHandler statistics = zip_memory(source.data(), source.size(), [&](size_t size) {
+            ScopedTimer timer(io);
+            target = MappedFile::create(output, size);
+            return target.data();
+        });
+        {
+            ScopedTimer timer(io);
+            target.close(statistics.outputData + statistics.additionalData);
         }
-        if (flag) out.write((char *)&tmp, sizeof(uint8_t));
-        statistics.inputData = in.tellg();
-        statistics.outputData = out.tellp();
-        statistics.outputData -= statistics.additionalData;
+        statistics.time.io += io;
         return statistics;
     }
 
-    StatHandler HuffmanArchiver::unzip(std::ifstream &in, std::ofstream &out) {
-        uint16_t size;
-        in.read((char *)&size, sizeof(uint16_t));
-        std::vector<int> freq(1 << CHAR_BIT);
-        int sum = 0;
-        for (int i = 0; i < size; i++) {
-            uint8_t ch;
-            int tmp;
-            in.read((char *)&ch, sizeof(uint8_t));
-            in.read((char *)&tmp, sizeof(int));
-            freq[ch] = tmp;
-            sum += tmp;
-        }
-        tree = std::make_unique<HuffTree>(freq);
-        return tree->decode(in, out, sum);
+    StatHandler HuffmanArchiver::zip(const uint8_t *data, size_t size, std::vector<uint8_t> &out) {
+        return zip_memory(data, size, [&out](size_t archive_size) {
+            out.resize(archive_size);
+            return out.data();
+        });
+    }
+
+    StatHandler HuffmanArchiver::zip(const uint8_t *data, size_t size, uint8_t *out, size_t capacity) {
+        return zip_memory(data, size, [out, capacity](size_t archive_size) {
+            if (archive_size > capacity) throw std::ios_base::failure("Output buffer is full");
+            return out;
+        });
+    }
+
+    template<class Table>
+    static inline uint32_t decode_symbol(BitReader &reader, const Table &table) {
+        uint32_t entry = table[reader.peek(Table::root_bits)];
+        uint32_t len, symbol;
+        if (DecodeTable::is_link(entry)) {
+            uint32_t sub_bits = DecodeTable::length(entry);
+            entry = table[DecodeTable::value(entry) + (reader.peek(Table::root_bits + sub_bits) & ((1u << sub_bits) - 1))];
+            len = Table::root_bits + DecodeTable::length(entry);
+            symbol = DecodeTable::value(entry);
+        } else if (DecodeTable::is_slow(entry)) {
+            len = table.decode_slow(reader.peek(64), reader.available(), symbol);
+            if (len == 0) throw std::ifstream::failure("Unexpected end of compressed data");
+        } else {
+            len = DecodeTable::length(entry);
+            symbol = DecodeTable::value(entry);
+        }
+        if ((int)len > reader.available()) throw std::ifstream::failure("Unexpected end of compressed data");
+        reader.consume(len);
+        return symbol;
+    }
+
+    // Every round decodes symbols from each sub-stream in turn, the chains of the sub-streams do not depend on each
+    // other. A refill leaves at least 57 bits in every reader, so with codes of at most longest bits several rounds
+    // are decoded per refill. The symbols left over after the last full refill are decoded one at a time by single.
+    template<int Streams, class Round, class Single>
+    static void decode_rounds(BitReader *readers, int longest, uint64_t cnt, Round &&round, Single &&single) {
+        const uint64_t per_refill = std::max(1, 57 / std::max(1, longest));
+        for (; cnt >= Streams * per_refill; cnt -= Streams * per_refill) {
+            for (int j = 0; j < Streams; j++) readers[j].refill();
+            for (uint64_t step = 0; step < per_refill; step++) round();
+        }
+        for (int j = 0; cnt > 0; j = (j + 1) % Streams, cnt--) {
+            readers[j].refill();
+            single(readers[j]);
+        }
+    }
+
+    // Calls decode with the number of sub-streams as a std::integral_constant, so that the decoders are instantiated
+    // for every count and the loops over the readers of a round are unrolled.
+    template<class Decode>
+    static void dispatch_streams(size_t streams, Decode &&decode) {
+        static_assert(HuffmanArchiver::max_streams == 8, "Every stream count needs a case");
+        switch (streams) {
+            case 1: return decode(std::integral_constant<int, 1>());
+            case 2: return decode(std::integral_constant<int, 2>());
+            case 3: return decode(std::integral_constant<int, 3>());
+            case 4: return decode(std::integral_constant<int, 4>());
+            case 5: return decode(std::integral_constant<int, 5>());
+            case 6: return decode(std::integral_constant<int, 6>());
+            case 7: return decode(std::integral_constant<int, 7>());
+            default: return decode(std::integral_constant<int, 8>());
+        }
+    }
+
+    // Symbols are gathered in a register and stored once per round, byte stores would otherwise force the reader
+    // state to be reloaded from memory after every symbol.
+    template<int Streams, class Table>
+    static void decode_interleaved(BitReader *readers, const Table &table, ByteWriter &out, uint64_t cnt) {
+        decode_rounds<Streams>(readers, table.longest_code(), cnt, [&]() {
+            uint64_t round = 0;
+            for (int j = 0; j < Streams; j++) round |= uint64_t(decode_symbol(readers[j], table)) << (8 * j);
+            std::memcpy(out.reserve(Streams), &round, Streams);
+            out.commit(Streams);
+        }, [&](BitReader &reader) {
+            out.put(uint8_t(decode_symbol(reader, table)));
+        });
+    }
+
+    // Table is a DecodeTable or a DecodeView of a dictionary.
+    template<class Table>
+    static void decode_symbols(std::vector<BitReader> &readers, const Table &table, ByteWriter &out, uint64_t cnt) {
+        dispatch_streams(readers.size(), [&](auto streams) {
+            decode_interleaved<decltype(streams)::value>(readers.data(), table, out, cnt);
+        });
+    }
+
+    static void read_context_header(ByteReader &in, PayloadHeader &header) {
+        uint8_t clusters, packed[context_map_size];
+        in.read_exact(&clusters, sizeof(uint8_t));
+        if (clusters < 2 || clusters > max_clusters) throw std::ifstream::failure("Invalid context clusters");
+        in.read_exact(packed, context_map_size);
+        header.contexts.resize(1 << CHAR_BIT);
+        for (size_t ctx = 0; ctx < header.contexts.size(); ctx++) {
+            header.contexts[ctx] = (packed[ctx / 2] >> ((ctx % 2) ? 0 : 4)) & 0xF;
+            if (header.contexts[ctx] >= clusters) throw std::ifstream::failure("Invalid context clusters");
+        }
+        header.clusters = clusters;
+        if (header.cluster_lengths.size() < clusters) header.cluster_lengths.resize(clusters);
+        for (size_t k = 0; k < clusters; k++) read_code_lengths(in, 1 << CHAR_BIT, header.cluster_lengths[k]);
+    }
+
+    // Leaf entries of the order-1 tables also carry the cluster of their symbol, above the symbol, so the table of
+    // the next symbol is found without a load. The tables of all clusters lie in one array, 2^shift entries apart.
+    struct ContextTable {
+        // A small root keeps the tables of all clusters in L1, longer codes take the second level.
+        static constexpr int root_bits = 8;
+
+        const uint32_t *entries;
+        const DecodeTable *table;
+        const uint8_t *contexts;
+
+        uint32_t operator[](uint32_t idx) const {
+            return entries[idx];
+        }
+
+        uint32_t decode_slow(uint64_t window, int available, uint32_t &symbol) const {
+            uint32_t len = table->decode_slow(window, available, symbol);
+            symbol |= uint32_t(contexts[symbol]) << CHAR_BIT;
+            return len;
+        }
+    };
+
+    // Order-1 counterpart of decode_interleaved: the table of every symbol is given by the symbol decoded before it,
+    // so the sub-streams take turns in a single chain, though their refills still do not depend on each other.
+    template<int Streams>
+    static void decode_context_interleaved(BitReader *readers, const uint32_t *entries, int shift, const DecodeTable *tables,
+                                           const uint8_t *contexts, int longest, ByteWriter &out, uint64_t cnt) {
+        ContextTable table = {entries + (contexts[0] << shift), tables + contexts[0], contexts};
+        auto next = [&](BitReader &reader) {
+            uint32_t value = decode_symbol(reader, table);
+            table.entries = entries + ((value >> CHAR_BIT) << shift);
+            table.table = tables + (value >> CHAR_BIT);
+            return uint8_t(value);
+        };
+        decode_rounds<Streams>(readers, longest, cnt, [&]() {
+            uint64_t round = 0;
+            for (int j = 0; j < Streams; j++) round |= uint64_t(next(readers[j])) << (8 * j);
+            std::memcpy(out.reserve(Streams), &round, Streams);
+            out.commit(Streams);
+        }, [&](BitReader &reader) {
+            out.put(next(reader));
+        });
+    }
+
+    static void decode_contexts(std::vector<BitReader> &readers, const PayloadHeader &header, BlockScratch &scratch, ByteWriter &out, PhaseTimes &time) {
+        const std::vector<DecodeTable> &tables = scratch.decode_tables;
+        std::vector<uint32_t> &entries = scratch.context_entries;
+        const uint8_t *contexts = header.contexts.data();
+        int shift = ContextTable::root_bits, longest = 0;
+        {
+            ScopedTimer timer(time.table);
+            for (size_t k = 0; k < header.clusters; k++) {
+                while (tables[k].size() > (size_t(1) << shift)) shift++;
+                longest = std::max(longest, tables[k].longest_code());
+            }
+            size_t stride = size_t(1) << shift;
+            entries.resize(header.clusters * stride);
+            for (size_t k = 0; k < header.clusters; k++) {
+                uint32_t *table = entries.data() + k * stride;
+                std::copy_n(tables[k].data(), tables[k].size(), table);
+                for (size_t i = 0; i < tables[k].size(); i++) {
+                    if (DecodeTable::is_slow(table[i]) || DecodeTable::is_link(table[i])) continue;
+                    table[i] |= uint32_t(contexts[DecodeTable::value(table[i])]) << (2 * CHAR_BIT);
+                }
+            }
+        }
+        ScopedTimer timer(time.coding);
+        const DecodeTable *clusters = tables.data();
+        dispatch_streams(readers.size(), [&](auto streams) {
+            decode_context_interleaved<decltype(streams)::value>(readers.data(), entries.data(), shift, clusters, contexts,
+                                                                 longest, out, header.cnt);
+        });
+    }
+
+    // Token counterpart of decode_interleaved: every symbol is a lexicon index and its whole slot is copied while the
+    // output has room for it, the output then advances by the length of the token. The indices of a round are
+    // decoded before any token is copied, so the copies do not get between the reader chains.
+    template<int Streams>
+    static void decode_token_interleaved(BitReader *readers, const DecodeTable &table, const uint8_t *lexicon, ByteWriter &out, uint64_t cnt) {
+        auto emit = [&out, lexicon](uint32_t id) {
+            const uint8_t *token = lexicon + size_t(id) * token_slot;
+            size_t len = token[max_token_size];
+            if (out.room() >= token_slot) {
+                std::memcpy(out.reserve(token_slot), token, token_slot);
+                out.commit(len);
+            } else {
+                out.write(token, len);
+            }
+        };
+        decode_rounds<Streams>(readers, table.longest_code(), cnt, [&]() {
+            uint32_t ids[Streams];
+            for (int j = 0; j < Streams; j++) ids[j] = decode_symbol(readers[j], table);
+            for (int j = 0; j < Streams; j++) emit(ids[j]);
+        }, [&](BitReader &reader) {
+            emit(decode_symbol(reader, table));
+        });
+    }
+
+    static void decode_tokens(std::vector<BitReader> &readers, const DecodeTable &table, const uint8_t *lexicon,
+                              const PayloadHeader &header, ByteWriter &out) {
+        uint64_t start = out.position();
+        dispatch_streams(readers.size(), [&](auto streams) {
+            decode_token_interleaved<decltype(streams)::value>(readers.data(), table, lexicon, out, header.symbols);
+        });
+        if (out.position() - start != header.cnt) throw std::ifstream::failure("Invalid token count");
+    }
+
+    // Wide symbol counterpart of decode_interleaved, every index is replaced by its symbol.
+    template<int Streams, class Symbol>
+    static void decode_wide_interleaved(BitReader *readers, const DecodeTable &table, const Symbol *alphabet, ByteWriter &out, uint64_t cnt) {
+        decode_rounds<Streams>(readers, table.longest_code(), cnt, [&]() {
+            Symbol round[Streams];
+            for (int j = 0; j < Streams; j++) round[j] = alphabet[decode_symbol(readers[j], table)];
+            std::memcpy(out.reserve(sizeof(round)), round, sizeof(round));
+            out.commit(sizeof(round));
+        }, [&](BitReader &reader) {
+            Symbol symbol = alphabet[decode_symbol(reader, table)];
+            out.write(&symbol, sizeof(Symbol));
+        });
+    }
+
+    template<class Symbol>
+    static void decode_wide(std::vector<BitReader> &readers, const DecodeTable &table, const Symbol *alphabet,
+                            const PayloadHeader &header, ByteWriter &out) {
+        dispatch_streams(readers.size(), [&](auto streams) {
+            decode_wide_interleaved<decltype(streams)::value>(readers.data(), table, alphabet, out, header.symbols);
+        });
+        if (!header.tail.empty()) out.write(header.tail.data(), header.tail.size());
+    }
+
+    // The alphabet of a token or wide symbol block: its size, then its coded form, which is only copied here.
+    static void read_alphabet_header(ByteReader &in, PayloadHeader &header, size_t max_size) {
+        uint64_t alphabet_size = read_varint(in);
+        if (alphabet_size == 0 || alphabet_size > max_size) throw std::ifstream::failure("Invalid alphabet size");
+        uint64_t size = read_varint(in);
+        if (size > in.available()) throw std::ifstream::failure("Invalid alphabet size");
+        header.alphabet_size = alphabet_size;
+        header.alphabet.resize(size);
+        in.read_exact(header.alphabet.data(), size);
+        read_dense_lengths(in, alphabet_size, header.lengths);
+    }
+
+    // Reads a block header into header, reusing its memory.
+    static void read_payload_header(ByteReader &in, PayloadHeader &header) {
+        uint8_t streams;
+        in.read_exact(&streams, sizeof(uint8_t));
+        header.shared = streams & dictionary_flag;
+        header.modeled = streams & context_flag;
+        header.tokenized = streams & token_flag;
+        bool wide = streams & symbol_flag;
+        streams &= ~(dictionary_flag | context_flag | token_flag | symbol_flag);
+        if (streams > HuffmanArchiver::max_streams || header.shared + header.modeled + header.tokenized + wide > 1
+                || ((header.shared || header.modeled || header.tokenized || wide) && streams == 0)) {
+            throw std::ifstream::failure("Invalid stream count");
+        }
+        header.streams = streams;
+        header.width = 1;
+        header.sizes.clear();
+        header.tail.clear();
+        if (header.shared || header.modeled || header.tokenized || wide) {
+            if (header.shared) {
+                in.read_exact(&header.dictionary, sizeof(uint32_t));
+            } else if (header.modeled) {
+                read_context_header(in, header);
+            } else if (header.tokenized) {
+                read_alphabet_header(in, header, max_vocabulary);
+            } else {
+                uint8_t width;
+                in.read_exact(&width, sizeof(uint8_t));
+                if (width != sizeof(uint16_t) && width != sizeof(uint32_t)) throw std::ifstream::failure("Invalid symbol width");
+                header.width = width;
+                read_alphabet_header(in, header, max_symbol_alphabet);
+            }
+            header.cnt = read_varint(in);
+            if (header.cnt > HuffmanArchiver::max_block_size) throw std::ifstream::failure("Invalid symbol count");
+            if (header.tokenized) {
+                // Every token expands to at least one byte.
+                header.symbols = read_varint(in);
+                if (header.symbols > header.cnt) throw std::ifstream::failure("Invalid token count");
+            }
+            if (wide) {
+                header.symbols = header.cnt / header.width;
+                header.tail.resize(header.cnt % header.width);
+                in.read_exact(header.tail.data(), header.tail.size());
+            }
+            for (int j = 0; j + 1 < streams; j++) header.sizes.push_back(read_varint(in));
+            return;
+        }
+        if (streams == adaptive_marker) {
+            header.cnt = read_varint(in);
+            if (header.cnt > HuffmanArchiver::max_block_size) throw std::ifstream::failure("Invalid symbol count");
+            return;
+        }
+        read_header(in, header.cnt, header.lengths);
+        if (header.cnt > HuffmanArchiver::max_block_size) throw std::ifstream::failure("Invalid symbol count");
+        if (has_payload(header.lengths)) {
+            for (int j = 0; j + 1 < streams; j++) header.sizes.push_back(read_varint(in));
+        }
+    }
+
+    // Decodes the payload that follows a block header, sub-streams except the last one span their jump table sizes.
+    // Blocks coded against a dictionary need the same dictionary, otherwise std::ifstream::failure is thrown.
+    static void decode_block(const PayloadHeader &header, const Dictionary *dictionary, const uint8_t *data, size_t size,
+                             ByteWriter &out, BlockScratch &scratch, PhaseTimes &time) {
+        if (header.shared) {
+            if (dictionary == nullptr || dictionary->id() != header.dictionary) throw std::ifstream::failure("Unknown dictionary");
+        } else if (!header.modeled && !header.tokenized && header.width == 1 && !has_payload(header.lengths)) {
+            ScopedTimer timer(time.coding);
+            uint8_t ch = std::find_if(header.lengths.begin(), header.lengths.end(), [](uint8_t len) { return len != 0; }) - header.lengths.begin();
+            out.fill(ch, header.cnt);
+            return;
+        }
+        std::vector<ByteReader> &sources = scratch.sources;
+        std::vector<BitReader> &readers = scratch.readers;
+        readers.clear();
+        sources.clear();
+        sources.reserve(header.streams);
+        for (uint64_t part : header.sizes) {
+            if (part > size) throw std::ifstream::failure("Invalid stream size");
+            readers.emplace_back(sources.emplace_back(data, part));
+            data += part;
+            size -= part;
+        }
+        readers.emplace_back(sources.emplace_back(data, size));
+        if (header.shared) {
+            ScopedTimer timer(time.coding);
+            decode_symbols(readers, dictionary->decode_table(), out, header.cnt);
+            return;
+        }
+        if (header.modeled) {
+            std::vector<DecodeTable> &tables = scratch.decode_tables;
+            {
+                ScopedTimer timer(time.table);
+                if (tables.size() < header.clusters) tables.resize(header.clusters);
+                for (size_t k = 0; k < header.clusters; k++) tables[k].build(header.cluster_lengths[k], ContextTable::root_bits);
+            }
+            decode_contexts(readers, header, scratch, out, time);
+            return;
+        }
+        {
+            ScopedTimer timer(time.table);
+            scratch.decode_table.build(header.lengths);
+            ByteReader alphabet(header.alphabet.data(), header.alphabet.size());
+            if (header.tokenized) {
+                read_lexicon(header.alphabet.data(), header.alphabet.size(), header.alphabet_size, scratch.tokens.lexicon, scratch.lexicon);
+            } else if (header.width == sizeof(uint16_t)) {
+                read_alphabet(alphabet, header.alphabet_size, scratch.narrow.symbols);
+            } else if (header.width == sizeof(uint32_t)) {
+                read_alphabet(alphabet, header.alphabet_size, scratch.wide.symbols);
+            }
+        }
+        ScopedTimer timer(time.coding);
+        if (header.tokenized) {
+            decode_tokens(readers, scratch.decode_table, scratch.tokens.lexicon.data(), header, out);
+            return;
+        }
+        if (header.width == sizeof(uint16_t)) {
+            decode_wide(readers, scratch.decode_table, scratch.narrow.symbols.data(), header, out);
+            return;
+        }
+        if (header.width == sizeof(uint32_t)) {
+            decode_wide(readers, scratch.decode_table, scratch.wide.symbols.data(), header, out);
+            return;
+        }
+        decode_symbols(readers, scratch.decode_table, out, header.cnt);
+    }
+
+    // Decodes an adaptive chunk into dst, which must have room for header.cnt bytes, and updates the model.
+    static void decode_chunk(AdaptiveModel &model, const PayloadHeader &header, const uint8_t *data, size_t size, uint8_t *dst, BlockScratch &scratch, PhaseTimes &time) {
+        ByteReader source(data, size);
+        ByteWriter target(dst, header.cnt);
+        scratch.readers.clear();
+        scratch.readers.emplace_back(source);
+        {
+            ScopedTimer timer(time.table);
+            scratch.decode_table.build(model.code_lengths());
+        }
+        {
+            ScopedTimer timer(time.coding);
+            decode_symbols(scratch.readers, scratch.decode_table, target, header.cnt);
+        }
+        std::vector<uint64_t> &freq = scratch.freq;
+        {
+            ScopedTimer timer(time.histogram);
+            freq.assign(1 << CHAR_BIT, 0);
+            count_frequencies(dst, header.cnt, freq);
+        }
+        model.update(freq, time);
+    }
+
+    // Parses the frame at the reader's position and skips it, returns false at the end marker. The framing and
+    // header bytes are added to overhead.
+    static bool read_frame(ByteReader &reader, Frame &frame, uint64_t &overhead) {
+        uint64_t start = reader.position(), size = read_varint(reader);
+        if (size == 0) {
+            overhead += reader.position() - start;
+            return false;
+        }
+        if (size > reader.available()) throw std::ifstream::failure("Unexpected end of input");
+        ByteReader body(reader.data(), size);
+        read_payload_header(body, frame.header);
+        frame.payload = body.data();
+        frame.size = body.available();
+        overhead += reader.position() - start + body.position();
+        reader.skip(size);
+        return true;
+    }
+
+    StatHandler HuffmanArchiver::unzip(std::istream &in, std::ostream &out) {
+        StatHandler statistics;
+        ByteReader reader(in.rdbuf(), buffer_size);
+        ByteWriter writer(out.rdbuf(), buffer_size);
+        Workspace &work = *workspace;
+        ThreadPool &pool = work.thread_pool(threads);
+        std::deque<std::future<CodedBlock>> pending;
+        auto write_next = [&]() {
+            CodedBlock block = pending.front().get();
+            pending.pop_front();
+            writer.write(block.data.data(), block.data.size());
+            statistics.additionalData += block.overhead;
+            statistics.time += block.time;
+        };
+        PayloadHeader header;
+        std::vector<uint8_t> &chunk = work.scratch.chunk;
+        work.model.reset();
+        while (true) {
+            uint64_t start = reader.position(), size = read_varint(reader);
+            if (size == 0) break;
+            if (size > max_body_size) throw std::ifstream::failure("Invalid block size");
+            std::vector<uint8_t> body(size);
+            reader.read_exact(body.data(), body.size());
+            if (body.front() == adaptive_marker) {
+                // Chunks depend on the model built from everything before them, so they are decoded in order.
+                while (!pending.empty()) write_next();
+                ByteReader source(body.data(), body.size());
+                read_payload_header(source, header);
+                chunk.resize(header.cnt);
+                decode_chunk(work.model, header, source.data(), source.available(), chunk.data(), work.scratch, statistics.time);
+                writer.write(chunk.data(), chunk.size());
+                statistics.additionalData += reader.position() - size - start + source.position();
+                continue;
+            }
+            pending.push_back(pool.submit([body = std::move(body), prefix = reader.position() - size - start, shared = dictionary.get()]() {
+                ByteReader source(body.data(), body.size());
+                PayloadHeader header;
+                read_payload_header(source, header);
+                CodedBlock decoded;
+                decoded.data.resize(header.cnt);
+                decoded.overhead = prefix + source.position();
+                ByteWriter target(decoded.data.data(), decoded.data.size());
+                BlockScratch scratch;
+                decode_block(header, shared, source.data(), source.available(), target, scratch, decoded.time);
+                return decoded;
+            }));
+            if (pending.size() >= 2 * (size_t)threads) write_next();
+        }
+        while (!pending.empty()) write_next();
+        writer.flush();
+        statistics.additionalData += varint_size(0);
+        // Whatever follows the end marker, such as the index, is auxiliary data.
+        while (reader.fill()) {
+            statistics.additionalData += reader.available();
+            reader.skip(reader.available());
+        }
+        statistics.inputData = reader.position() - statistics.additionalData;
+        statistics.outputData = writer.position();
+        statistics.time.io += reader.wait_time() + writer.wait_time();
+        return statistics;
+    }
+
+    StatHandler HuffmanArchiver::unzip_memory(const uint8_t *data, size_t size, const Allocator &allocate) {
+        StatHandler statistics;
+        Workspace &work = *workspace;
+        ByteReader reader(data, size);
+
+        // Headers are parsed up front to place every block in the output, the payloads are decoded in parallel.
+        // Adaptive chunks depend on each other and are decoded in order before that.
+        std::vector<Frame> &frames = work.frames;
+        size_t count = 0;
+        uint64_t total = 0;
+        while (true) {
+            if (count == frames.size()) frames.emplace_back();
+            Frame &frame = frames[count];
+            if (!read_frame(reader, frame, statistics.additionalData)) break;
+            frame.offset = total;
+            frame.time = PhaseTimes();
+            total += frame.header.cnt;
+            count++;
+        }
+        statistics.additionalData += reader.available();
+
+        uint8_t *target = allocate(total);
+        work.model.reset();
+        for (size_t i = 0; i < count; i++) {
+            const Frame &frame = frames[i];
+            if (frame.header.streams != adaptive_marker) continue;
+            decode_chunk(work.model, frame.header, frame.payload, frame.size, target + frame.offset, work.scratch, statistics.time);
+        }
+        for_each_block(work.thread_pool(threads), count, work.scratch, [&](size_t i, BlockScratch &scratch) {
+            Frame &frame = frames[i];
+            if (frame.header.streams == adaptive_marker) return;
+            ByteWriter writer(target + frame.offset, frame.header.cnt);
+            decode_block(frame.header, dictionary.get(), frame.payload, frame.size, writer, scratch, frame.time);
+        });
+        for (size_t i = 0; i < count; i++) statistics.time += frames[i].time;
+        statistics.inputData = size - statistics.additionalData;
+        statistics.outputData = total;
+        return statistics;
+    }
+
+    StatHandler HuffmanArchiver::unzip_file(const std::string &input, const std::string &output) {
+        uint64_t io = 0;
+        MappedFile source, target;
+        {
+            ScopedTimer timer(io);
+            source = MappedFile::open_read(input);
+        }
+        StatHandler statistics = unzip_memory(source.data(), source.size(), [&](size_t size) {
+            ScopedTimer timer(io);
+            target = MappedFile::create(output, size);
+            return target.data();
+        });
+        {
+            ScopedTimer timer(io);
+            target.close(statistics.outputData);
+        }
+        statistics.time.io += io;
+        return statistics;
+    }
+
+    StatHandler HuffmanArchiver::unzip(const uint8_t *data, size_t size, std::vector<uint8_t> &out) {
+        return unzip_memory(data, size, [&out](size_t data_size) {
+            out.resize(data_size);
+            return out.data();
+        });
+    }
+
+    StatHandler HuffmanArchiver::unzip(const uint8_t *data, size_t size, uint8_t *out, size_t capacity) {
+        return unzip_memory(data, size, [out, capacity](size_t data_size) {
+            if (data_size > capacity) throw std::ios_base::failure("Output buffer is full");
+            return out;
+        });
+    }
+
+    StatHandler HuffmanArchiver::unzip_range(const std::string &input, std::ostream &out, uint64_t start, uint64_t length) {
+        if (length > UINT64_MAX - start) throw std::invalid_argument("Invalid range!");
+        StatHandler statistics;
+        MappedFile source;
+        {
+            ScopedTimer timer(statistics.time.io);
+            source = MappedFile::open_read(input);
+        }
+
+        // The index locates the covering blocks directly, without it every frame header up to the range is parsed.
+        std::vector<Frame> frames;
+        std::vector<IndexEntry> entries;
+        uint64_t total = 0;
+        Frame next;
+        if (read_index(source.data(), source.size(), entries)) {
+            uint64_t position = 0;
+            for (const IndexEntry &entry : entries) {
+                if (total < start + length && total + entry.raw_size > start) {
+                    ByteReader reader(source.data() + position, entry.frame_size);
+                    if (!read_frame(reader, next, statistics.additionalData) || next.header.cnt != entry.raw_size) {
+                        throw std::ifstream::failure("Invalid index");
+                    }
+                    next.offset = total;
+                    frames.push_back(std::move(next));
+                }
+                total += entry.raw_size;
+                position += entry.frame_size;
+            }
+        } else {
+            ByteReader reader(source.data(), source.size());
+            uint64_t overhead = 0;
+            while (total < start + length && read_frame(reader, next, overhead)) {
+                if (total + next.header.cnt > start) {
+                    next.offset = total;
+                    frames.push_back(std::move(next));
+                    statistics.additionalData += overhead;
+                }
+                total += next.header.cnt;
+                overhead = 0;
+            }
+        }
+        if (start > total || length > total - start) throw std::invalid_argument("Invalid range!");
+        for (const Frame &frame : frames) {
+            if (frame.header.streams == adaptive_marker) throw std::ifstream::failure("Adaptive archives can not be read by range");
+            statistics.inputData += frame.size;
+        }
+
+        ByteWriter writer(out.rdbuf(), buffer_size);
+        ThreadPool &pool = workspace->thread_pool(threads);
+        std::deque<std::future<CodedBlock>> pending;
+        size_t written = 0;
+        auto write_next = [&]() {
+            // Popped before get, which leaves the future without state when the block fails to decode.
+            std::future<CodedBlock> task = std::move(pending.front());
+            pending.pop_front();
+            CodedBlock block = task.get();
+            statistics.time += block.time;
+            const Frame &frame = frames[written++];
+            uint64_t from = std::max(start, frame.offset) - frame.offset;
+            uint64_t to = std::min(start + length, frame.offset + frame.header.cnt) - frame.offset;
+            writer.write(block.data.data() + from, to - from);
+        };
+        try {
+            for (const Frame &frame : frames) {
+                pending.push_back(pool.submit([&frame, shared = dictionary.get()]() {
+                    CodedBlock decoded;
+                    decoded.data.resize(frame.header.cnt);
+                    ByteWriter target(decoded.data.data(), decoded.data.size());
+                    BlockScratch scratch;
+                    decode_block(frame.header, shared, frame.payload, frame.size, target, scratch, decoded.time);
+                    return decoded;
+                }));
+                if (pending.size() >= 2 * (size_t)threads) write_next();
+            }
+            while (!pending.empty()) write_next();
+        } catch (...) {
+            // The pool outlives this call, tasks still queued refer to the frames and the mapped archive.
+            for (auto &task : pending) task.wait();
+            throw;
+        }
+        writer.flush();
+        statistics.outputData = writer.position();
+        statistics.time.io += writer.wait_time();
+        return statistics;
+    }
+
+    // The samples are treated as one concatenated stream cut into slices, a slice may span many small files or be
+    // a part of a large one. Every task streams its slice through a buffer into a private histogram.
+    StatHandler HuffmanArchiver::train(const std::string &samples, const std::string &output) {
+        if (max_code_length < Dictionary::min_code_length || max_code_length > Dictionary::max_code_length) {
+            throw std::invalid_argument("Invalid maximum code length!");
+        }
+        StatHandler statistics;
+        std::vector<std::string> files;
+        std::vector<uint64_t> ends;
+        uint64_t total = 0;
+        try {
+            ScopedTimer timer(statistics.time.io);
+            if (std::filesystem::is_directory(samples)) {
+                for (const auto &entry : std::filesystem::recursive_directory_iterator(samples)) {
+                    if (entry.is_regular_file()) files.push_back(entry.path().string());
+                }
+                std::sort(files.begin(), files.end());
+            } else {
+                files.push_back(samples);
+            }
+            for (const std::string &file : files) {
+                total += std::filesystem::file_size(file);
+                ends.push_back(total);
+            }
+        } catch (const std::filesystem::filesystem_error &) {
+            throw std::ios_base::failure("Unable to open file");
+        }
+
+        std::vector<uint64_t> freq(1 << CHAR_BIT, 0);
+        std::mutex lock;
+        size_t count = (total + block_size - 1) / block_size;
+        workspace->thread_pool(threads).for_each(count, [&](size_t i) {
+            uint64_t position = i * block_size, end = std::min<uint64_t>(position + block_size, total), counted = 0;
+            std::vector<uint64_t> local(1 << CHAR_BIT, 0);
+            PhaseTimes time;
+            size_t file = std::upper_bound(ends.begin(), ends.end(), position) - ends.begin();
+            for (; position < end; file++) {
+                if (ends[file] <= position) continue;
+                std::ifstream in(files[file], std::ios::binary);
+                if (!in.is_open()) throw std::ios_base::failure("Unable to open file");
+                in.seekg(position - (file == 0 ? 0 : ends[file - 1]));
+                // Files that shrank since they were listed are counted as far as they go.
+                ByteReader reader(in.rdbuf(), buffer_size);
+                uint64_t remaining = std::min(end, ends[file]) - position;
+                while (remaining != 0 && reader.fill()) {
+                    size_t part = std::min<uint64_t>(remaining, reader.available());
+                    {
+                        ScopedTimer timer(time.histogram);
+                        count_frequencies(reader.data(), part, local);
+                    }
+                    reader.skip(part);
+                    remaining -= part;
+                    counted += part;
+                }
+                time.io += reader.wait_time();
+                position = std::min(end, ends[file]);
+            }
+            std::lock_guard<std::mutex> guard(lock);
+            for (size_t ch = 0; ch < freq.size(); ch++) freq[ch] += local[ch];
+            statistics.inputData += counted;
+            statistics.time += time;
+        });
+
+        std::unique_ptr<Dictionary> dictionary;
+        {
+            ScopedTimer timer(statistics.time.tree);
+            dictionary = std::make_unique<Dictionary>(Dictionary::train(freq, max_code_length));
+        }
+        {
+            ScopedTimer timer(statistics.time.io);
+            dictionary->save(output);
+        }
+        statistics.outputData = dictionary->size();
+        return statistics;
     }
 
 }
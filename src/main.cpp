@@ -1,7 +1,10 @@
 #include "huffman.h"
+#include "dictionary.h"
 #include <iostream>
 #include <fstream>
 #include <cstring>
+#include <chrono>
+#include <filesystem>
 
 class FileNotFoundException : public std::exception {
 private:
@@ -13,9 +16,40 @@ public:
     }
 };
 
-static int parse_arguments(int argc, char *argv[], std::ifstream &in, std::ofstream &out) {
+static int parse_number(const char *arg) {
+    std::string_view str(arg);
+    if (str.empty() || str.size() > 9 || str.find_first_not_of("0123456789") != std::string_view::npos) {
+        throw std::invalid_argument("Invalid arguments!");
+    }
+    return std::stoi(std::string(str));
+}
+
+static uint64_t parse_offset(std::string_view str) {
+    if (str.empty() || str.size() > 19 || str.find_first_not_of("0123456789") != std::string_view::npos) {
+        throw std::invalid_argument("Invalid arguments!");
+    }
+    return std::stoull(std::string(str));
+}
+
+static void set_dictionary(huffman::HuffmanArchiver &archiver, const char *path) {
+    std::ifstream probe(path);
+    if (!probe.is_open()) throw FileNotFoundException("Unable to open dictionary file!");
+    archiver.set_dictionary(std::make_shared<const huffman::Dictionary>(huffman::Dictionary::load(path)));
+}
+
+struct Arguments {
     int mode = 0;
+    bool mapped = false;
+    bool ranged = false;
+    bool json = false;
+    uint64_t start = 0, length = 0;
     std::string IFile, OFile;
+};
+
+static Arguments parse_arguments(int argc, char *argv[], huffman::HuffmanArchiver &archiver) {
+    Arguments args;
+    int &mode = args.mode;
+    std::string &IFile = args.IFile, &OFile = args.OFile;
     for (int i = 1; i < argc; i++) {
         std::string_view str(argv[i]);
         if (str.size() == 1) throw std::invalid_argument("Invalid arguments!");
@@ -30,6 +64,75 @@ static int parse_arguments(int argc, char *argv[], std::ifstream &in, std::ofstr
                 OFile = argv[i];
                 continue;
             }
+            if (str == "--mmap") {
+                args.mapped = true;
+                continue;
+            }
+            if (str == "--buffer-size") {
+                if (++i == argc) throw std::invalid_argument("Invalid arguments!");
+                archiver.set_buffer_size(parse_number(argv[i]));
+                continue;
+            }
+            if (str == "--streams") {
+                if (++i == argc) throw std::invalid_argument("Invalid arguments!");
+                archiver.set_streams(parse_number(argv[i]));
+                continue;
+            }
+            if (str == "--train") {
+                if (mode != 0) throw std::invalid_argument("Invalid arguments!");
+                mode = 3;
+                continue;
+            }
+            if (str == "--index") {
+                archiver.set_index(true);
+                continue;
+            }
+            if (str == "--range") {
+                if (++i == argc || args.ranged) throw std::invalid_argument("Invalid arguments!");
+                std::string_view range(argv[i]);
+                size_t colon = range.find(':');
+                if (colon == std::string_view::npos) throw std::invalid_argument("Invalid arguments!");
+                args.start = parse_offset(range.substr(0, colon));
+                args.length = parse_offset(range.substr(colon + 1));
+                args.ranged = true;
+                continue;
+            }
+            if (str == "--stats=json" || str == "--stats=text") {
+                args.json = (str == "--stats=json");
+                continue;
+            }
+            if (str == "--contexts") {
+                archiver.set_contexts(true);
+                continue;
+            }
+            if (str == "--symbol-width") {
+                if (++i == argc) throw std::invalid_argument("Invalid arguments!");
+                archiver.set_symbol_width(parse_number(argv[i]));
+                continue;
+            }
+            if (str == "--words") {
+                archiver.set_tokens(true);
+                continue;
+            }
+            if (str == "--adaptive") {
+                archiver.set_adaptive(true);
+                continue;
+            }
+            if (str == "--threads") {
+                if (++i == argc) throw std::invalid_argument("Invalid arguments!");
+                archiver.set_threads(parse_number(argv[i]));
+                continue;
+            }
+            if (str == "--dictionary") {
+                if (++i == argc) throw std::invalid_argument("Invalid arguments!");
+                set_dictionary(archiver, argv[i]);
+                continue;
+            }
+            if (str == "--max-length") {
+                if (++i == argc) throw std::invalid_argument("Invalid arguments!");
+                archiver.set_max_code_length(parse_number(argv[i]));
+                continue;
+            }
             throw std::invalid_argument("Invalid arguments!");
         }
         if (str[0] == '-') {
@@ -50,41 +153,129 @@ static int parse_arguments(int argc, char *argv[], std::ifstream &in, std::ofstr
                     if (++i == argc || !OFile.empty()) throw std::invalid_argument("Invalid arguments!");
                     OFile = argv[i];
                     break;
+                case 'm':
+                    args.mapped = true;
+                    break;
+                case 'b':
+                    if (++i == argc) throw std::invalid_argument("Invalid arguments!");
+                    archiver.set_buffer_size(parse_number(argv[i]));
+                    break;
+                case 's':
+                    if (++i == argc) throw std::invalid_argument("Invalid arguments!");
+                    archiver.set_streams(parse_number(argv[i]));
+                    break;
+                case 'i':
+                    archiver.set_index(true);
+                    break;
+                case 'a':
+                    archiver.set_adaptive(true);
+                    break;
+                case 'x':
+                    archiver.set_contexts(true);
+                    break;
+                case 'w':
+                    archiver.set_tokens(true);
+                    break;
+                case 'j':
+                    if (++i == argc) throw std::invalid_argument("Invalid arguments!");
+                    archiver.set_threads(parse_number(argv[i]));
+                    break;
+                case 'l':
+                    if (++i == argc) throw std::invalid_argument("Invalid arguments!");
+                    archiver.set_max_code_length(parse_number(argv[i]));
+                    break;
+                case 'd':
+                    if (++i == argc) throw std::invalid_argument("Invalid arguments!");
+                    set_dictionary(archiver, argv[i]);
+                    break;
                 default:
                     throw std::invalid_argument("Invalid arguments!");
             }
         }
     }
     if (mode == 0 || IFile.empty() || OFile.empty()) throw std::invalid_argument("Invalid arguments!");
-    in.open(IFile);
-    if (!in.is_open()) throw FileNotFoundException("Unable to open input file!");
-    in.exceptions(std::ifstream::failbit | std::ifstream::eofbit);
-    out.open(OFile);
-    if (!out.is_open()) throw FileNotFoundException("Unable to open output file!");
-    return mode;
+    if (args.mapped && (IFile == "-" || OFile == "-")) throw std::invalid_argument("Invalid arguments!");
+    if (args.ranged && (mode != 2 || IFile == "-")) throw std::invalid_argument("Invalid arguments!");
+    if (mode == 3 && (IFile == "-" || OFile == "-" || args.mapped)) throw std::invalid_argument("Invalid arguments!");
+    return args;
+}
+
+// The default report is the three byte counts, one per line. The JSON report adds the time of every phase and the
+// elapsed time, all in nanoseconds.
+static void print_statistics(std::ostream &out, const huffman::StatHandler &statistics, bool json, uint64_t elapsed) {
+    if (!json) {
+        out << statistics.inputData << '\n';
+        out << statistics.outputData << '\n';
+        out << statistics.additionalData << '\n';
+        return;
+    }
+    const huffman::PhaseTimes &time = statistics.time;
+    out << "{\"input\": " << statistics.inputData << ", \"output\": " << statistics.outputData
+        << ", \"additional\": " << statistics.additionalData << ", \"time_ns\": {\"histogram\": " << time.histogram
+        << ", \"tree\": " << time.tree << ", \"table\": " << time.table << ", \"coding\": " << time.coding
+        << ", \"io\": " << time.io << ", \"elapsed\": " << elapsed << "}}\n";
+}
+
+// "-" stands for the standard input or output, which are left to the caller.
+static void open_files(const Arguments &args, std::ifstream &in, std::ofstream &out) {
+    if (args.IFile != "-") {
+        in.open(args.IFile);
+        if (!in.is_open()) throw FileNotFoundException("Unable to open input file!");
+        in.exceptions(std::ifstream::failbit | std::ifstream::eofbit);
+    }
+    if (args.OFile != "-") {
+        out.open(args.OFile);
+        if (!out.is_open()) throw FileNotFoundException("Unable to open output file!");
+    }
 }
 
 int main(int argc, char *argv[]) {
+    std::ios_base::sync_with_stdio(false);
+    // Messages go to the standard error stream while the archive itself is written to the standard output.
+    std::ostream *report = &std::cout;
     try {
         std::ifstream in;
         std::ofstream out;
-        int mode = parse_arguments(argc, argv, in, out);
         huffman::HuffmanArchiver archiver;
-        huffman::StatHandler statistics = (mode == 1) ? archiver.zip(in, out) : archiver.unzip(in, out);
-        std::cout << statistics.inputData << '\n';
-        std::cout << statistics.outputData << '\n';
-        std::cout << statistics.additionalData << '\n';
+        Arguments args = parse_arguments(argc, argv, archiver);
+        if (args.OFile == "-") report = &std::cerr;
+        if (args.mode != 3) open_files(args, in, out);
+        huffman::StatHandler statistics;
+        auto started = std::chrono::steady_clock::now();
+        if (args.mode == 3) {
+            // The samples are a file or a directory, the archiver reads them itself. A path that can not be checked
+            // is reported like a missing one.
+            std::error_code error;
+            if (!std::filesystem::exists(args.IFile, error)) throw FileNotFoundException("Unable to open input file!");
+            statistics = archiver.train(args.IFile, args.OFile);
+        } else if (args.ranged) {
+            in.close();
+            std::ostream &output = (args.OFile == "-") ? std::cout : out;
+            statistics = archiver.unzip_range(args.IFile, output, args.start, args.length);
+            output.flush();
+        } else if (args.mapped) {
+            in.close();
+            out.close();
+            statistics = (args.mode == 1) ? archiver.zip_file(args.IFile, args.OFile) : archiver.unzip_file(args.IFile, args.OFile);
+        } else {
+            std::istream &input = (args.IFile == "-") ? std::cin : in;
+            std::ostream &output = (args.OFile == "-") ? std::cout : out;
+            statistics = (args.mode == 1) ? archiver.zip(input, output) : archiver.unzip(input, output);
+            output.flush();
+        }
+        auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - started);
+        print_statistics(*report, statistics, args.json, elapsed.count());
     } catch (std::invalid_argument &e) {
-        std::cout << e.what() << '\n';
+        *report << e.what() << '\n';
         return 1;
     } catch (FileNotFoundException &e) {
-        std::cout << e.what() << '\n';
+        *report << e.what() << '\n';
         return 2;
     } catch (std::bad_alloc &e) {
-        std::cout << "Unable to allocate memory!\n";
+        *report << "Unable to allocate memory!\n";
         return 3;
     } catch (std::ifstream::failure &e) {
-        std::cout << "Invalid input file format!\n";
+        *report << "Invalid input file format!\n";
         return 4;
     }
     return 0;
@@ -0,0 +1,71 @@
+#include "mapped_file.h"
+#include <ios>
+#include <utility>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace huffman {
+
+    MappedFile::MappedFile(int descriptor, size_t size, bool writable) : fd(descriptor), length(size) {
+        if (length == 0) return;
+        void *ptr = mmap(nullptr, length, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+        if (ptr == MAP_FAILED) {
+            ::close(fd);
+            fd = -1;
+            throw std::ios_base::failure("Unable to map file");
+        }
+        addr = (uint8_t *)ptr;
+        madvise(addr, length, MADV_SEQUENTIAL);
+    }
+
+    MappedFile::MappedFile(MappedFile &&other) noexcept
+            : fd(std::exchange(other.fd, -1)), addr(std::exchange(other.addr, nullptr)), length(std::exchange(other.length, 0)) {}
+
+    MappedFile & MappedFile::operator=(MappedFile &&other) noexcept {
+        std::swap(fd, other.fd);
+        std::swap(addr, other.addr);
+        std::swap(length, other.length);
+        return *this;
+    }
+
+    MappedFile::~MappedFile() {
+        if (addr != nullptr) munmap(addr, length);
+        if (fd != -1) ::close(fd);
+    }
+
+    MappedFile MappedFile::open_read(const std::string &path) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd == -1) throw std::ios_base::failure("Unable to open file");
+        struct stat info{};
+        if (fstat(fd, &info) != 0) {
+            ::close(fd);
+            throw std::ios_base::failure("Unable to open file");
+        }
+        return MappedFile(fd, (size_t)info.st_size, false);
+    }
+
+    MappedFile MappedFile::create(const std::string &path, size_t size) {
+        int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd == -1) throw std::ios_base::failure("Unable to open file");
+        // posix_fallocate may be unsupported by the file system, ftruncate alone still gives a valid mapping.
+        if (ftruncate(fd, (off_t)size) != 0) {
+            ::close(fd);
+            throw std::ios_base::failure("Unable to allocate file");
+        }
+        if (size != 0) posix_fallocate(fd, 0, (off_t)size);
+        return MappedFile(fd, size, true);
+    }
+
+    void MappedFile::close(size_t final_size) {
+        if (addr != nullptr) munmap(addr, length);
+        addr = nullptr;
+        bool resized = fd == -1 || final_size == length || ftruncate(fd, (off_t)final_size) == 0;
+        if (fd != -1) ::close(fd);
+        fd = -1;
+        length = 0;
+        if (!resized) throw std::ios_base::failure("Unable to resize file");
+    }
+
+}
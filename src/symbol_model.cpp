@@ -0,0 +1,118 @@
+#include "symbol_model.h"
+#include <ios>
+#include <limits>
+#include <cstring>
+
+namespace huffman {
+
+    template<class Symbol>
+    static Symbol load_symbol(const uint8_t *data) {
+        Symbol symbol;
+        std::memcpy(&symbol, data, sizeof(Symbol));
+        return symbol;
+    }
+
+    // Every symbol value has a counter and an index, the present symbols come out in increasing order on their own.
+    static bool count_dense(const uint8_t *data, size_t count, size_t alphabet_limit, SymbolAlphabet<uint16_t> &alphabet) {
+        const size_t values = size_t(1) << 16;
+        std::vector<uint32_t> &remap = alphabet.remap, &ids = alphabet.ids;
+        remap.assign(values, 0);
+        for (size_t i = 0; i < count; i++) remap[load_symbol<uint16_t>(data + i * sizeof(uint16_t))]++;
+        alphabet.symbols.clear();
+        alphabet.counts.clear();
+        for (uint32_t value = 0; value < values; value++) {
+            if (remap[value] == 0) continue;
+            if (alphabet.symbols.size() == alphabet_limit) return false;
+            alphabet.counts.push_back(remap[value]);
+            remap[value] = alphabet.symbols.size();
+            alphabet.symbols.push_back(value);
+        }
+        ids.resize(count);
+        for (size_t i = 0; i < count; i++) ids[i] = remap[load_symbol<uint16_t>(data + i * sizeof(uint16_t))];
+        return true;
+    }
+
+    static uint64_t hash_symbol(uint32_t symbol) {
+        return symbol * 0x9E3779B97F4A7C15ull;
+    }
+
+    // Symbols get ids in order of appearance and are sorted at the end.
+    static bool count_hashed(const uint8_t *data, size_t count, size_t alphabet_limit, SymbolAlphabet<uint32_t> &alphabet) {
+        std::vector<uint32_t> &found = alphabet.found, &ids = alphabet.ids;
+        std::vector<uint64_t> &found_counts = alphabet.found_counts;
+        KeyIndex &index = alphabet.index;
+        found.clear();
+        found_counts.clear();
+        ids.resize(count);
+        index.clear();
+        for (size_t i = 0; i < count; i++) {
+            uint32_t symbol = load_symbol<uint32_t>(data + i * sizeof(uint32_t));
+            uint32_t &entry = index.find(hash_symbol(symbol), [&found, symbol](uint32_t id) {
+                return found[id] == symbol;
+            });
+            uint32_t id = entry;
+            if (id == KeyIndex::empty) {
+                if (found.size() == alphabet_limit) return false;
+                id = entry = found.size();
+                found.push_back(symbol);
+                found_counts.push_back(0);
+                index.added(found.size(), [&found](uint32_t id) {
+                    return hash_symbol(found[id]);
+                });
+            }
+            found_counts[id]++;
+            ids[i] = id;
+        }
+
+        const std::vector<uint32_t> &order = alphabet.order;
+        size_t size = found.size();
+        sort_ids(size, ids, alphabet.order, alphabet.remap, [&found](uint32_t a, uint32_t b) {
+            return found[a] < found[b];
+        });
+        alphabet.symbols.resize(size);
+        alphabet.counts.resize(size);
+        for (uint32_t id = 0; id < size; id++) {
+            alphabet.symbols[id] = found[order[id]];
+            alphabet.counts[id] = found_counts[order[id]];
+        }
+        return true;
+    }
+
+    template<class Symbol>
+    bool count_symbols(const uint8_t *data, size_t count, size_t alphabet_limit, SymbolAlphabet<Symbol> &alphabet) {
+        if constexpr (sizeof(Symbol) == sizeof(uint16_t)) {
+            return count_dense(data, count, alphabet_limit, alphabet);
+        } else {
+            return count_hashed(data, count, alphabet_limit, alphabet);
+        }
+    }
+
+    template<class Symbol>
+    void write_alphabet(ByteWriter &out, const std::vector<Symbol> &symbols) {
+        for (size_t i = 0; i < symbols.size(); i++) {
+            write_varint(out, i == 0 ? symbols[i] : symbols[i] - symbols[i - 1] - 1);
+        }
+    }
+
+    template<class Symbol>
+    void read_alphabet(ByteReader &in, size_t count, std::vector<Symbol> &symbols) {
+        symbols.resize(count);
+        uint64_t next = 0;
+        for (size_t i = 0; i < count; i++) {
+            uint64_t gap = read_varint(in);
+            if (gap > std::numeric_limits<Symbol>::max() || next + gap > std::numeric_limits<Symbol>::max()) {
+                throw std::ios_base::failure("Invalid alphabet");
+            }
+            symbols[i] = next + gap;
+            next = uint64_t(symbols[i]) + 1;
+        }
+    }
+
+    template bool count_symbols<uint16_t>(const uint8_t *, size_t, size_t, SymbolAlphabet<uint16_t> &);
+    template bool count_symbols<uint32_t>(const uint8_t *, size_t, size_t, SymbolAlphabet<uint32_t> &);
+    template void write_alphabet<uint16_t>(ByteWriter &, const std::vector<uint16_t> &);
+    template void write_alphabet<uint32_t>(ByteWriter &, const std::vector<uint32_t> &);
+    template void read_alphabet<uint16_t>(ByteReader &, size_t, std::vector<uint16_t> &);
+    template void read_alphabet<uint32_t>(ByteReader &, size_t, std::vector<uint32_t> &);
+
+}
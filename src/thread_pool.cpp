@@ -0,0 +1,34 @@
+#include "thread_pool.h"
+
+namespace huffman {
+
+    ThreadPool::ThreadPool(int threads) {
+        if (threads <= 1) return;
+        workers.reserve(threads);
+        for (int i = 0; i < threads; i++) workers.emplace_back([this]() { run(); });
+    }
+
+    ThreadPool::~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stopping = true;
+        }
+        ready.notify_all();
+        for (std::thread &worker : workers) worker.join();
+    }
+
+    void ThreadPool::run() {
+        while (true) {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> guard(lock);
+                ready.wait(guard, [this]() { return stopping || !tasks.empty(); });
+                if (tasks.empty()) return;
+                task = std::move(tasks.front());
+                tasks.pop_front();
+            }
+            task();
+        }
+    }
+
+}
@@ -0,0 +1,150 @@
+#include "token_model.h"
+#include "bit_io.h"
+#include <climits>
+#include <ios>
+#include <cstring>
+#include <algorithm>
+
+namespace huffman {
+
+    // Once this many tokens are seen, data where more than half of the tokens are new is not taken for text.
+    static constexpr size_t probe_tokens = 1 << 12;
+
+    static constexpr bool is_word(uint8_t ch) {
+        return (ch >= '0' && ch <= '9') || ((ch | 0x20) >= 'a' && (ch | 0x20) <= 'z') || ch >= 0x80;
+    }
+
+    struct WordBytes {
+        bool word[256] = {};
+
+        constexpr WordBytes() {
+            for (int ch = 0; ch < 256; ch++) word[ch] = is_word(ch);
+        }
+    };
+
+    static constexpr WordBytes word_bytes;
+
+    static size_t token_size(const uint8_t *slot) {
+        return slot[max_token_size];
+    }
+
+    static uint64_t hash_token(const uint8_t *slot) {
+        uint64_t low, high;
+        std::memcpy(&low, slot, sizeof(uint64_t));
+        std::memcpy(&high, slot + sizeof(uint64_t), sizeof(uint64_t));
+        return ((low * 0x9E3779B97F4A7C15ull) ^ high) * 0xC2B2AE3D27D4EB4Full;
+    }
+
+    static bool token_less(const uint8_t *a, const uint8_t *b) {
+        size_t a_size = token_size(a), b_size = token_size(b);
+        int order = std::memcmp(a, b, std::min(a_size, b_size));
+        return order < 0 || (order == 0 && a_size < b_size);
+    }
+
+    bool tokenize(const uint8_t *data, size_t size, size_t vocabulary_limit, Tokens &tokens) {
+        std::vector<uint8_t> &keys = tokens.keys;
+        std::vector<uint64_t> &found = tokens.found;
+        std::vector<uint32_t> &ids = tokens.ids;
+        KeyIndex &index = tokens.index;
+        keys.clear();
+        found.clear();
+        ids.clear();
+        index.clear();
+        for (size_t i = 0; i < size;) {
+            bool word = word_bytes.word[data[i]];
+            size_t len = 1, end = std::min(size - i, max_token_size);
+            while (len < end && word_bytes.word[data[i + len]] == word) len++;
+            uint8_t slot[token_slot] = {};
+            std::memcpy(slot, data + i, len);
+            slot[max_token_size] = len;
+            i += len;
+            uint32_t &entry = index.find(hash_token(slot), [&keys, &slot](uint32_t id) {
+                return std::memcmp(&keys[id * token_slot], slot, token_slot) == 0;
+            });
+            uint32_t id = entry;
+            if (id == KeyIndex::empty) {
+                if (found.size() == vocabulary_limit || (ids.size() >= probe_tokens && 2 * found.size() > ids.size())) {
+                    return false;
+                }
+                id = entry = found.size();
+                keys.insert(keys.end(), slot, slot + token_slot);
+                found.push_back(0);
+                index.added(found.size(), [&keys](uint32_t id) {
+                    return hash_token(&keys[id * token_slot]);
+                });
+            }
+            found[id]++;
+            ids.push_back(id);
+        }
+
+        const std::vector<uint32_t> &order = tokens.order;
+        size_t vocabulary = found.size();
+        sort_ids(vocabulary, ids, tokens.order, tokens.remap, [&keys](uint32_t a, uint32_t b) {
+            return token_less(&keys[a * token_slot], &keys[b * token_slot]);
+        });
+        tokens.lexicon.resize(vocabulary * token_slot);
+        tokens.counts.resize(vocabulary);
+        for (uint32_t id = 0; id < vocabulary; id++) {
+            std::memcpy(&tokens.lexicon[id * token_slot], &keys[order[id] * token_slot], token_slot);
+            tokens.counts[id] = found[order[id]];
+        }
+        return true;
+    }
+
+    static constexpr size_t byte_alphabet = 1 << CHAR_BIT;
+
+    void write_lexicon(ByteWriter &out, const std::vector<uint8_t> &lexicon, LexiconScratch &scratch) {
+        std::vector<uint8_t> &bytes = scratch.bytes;
+        bytes.clear();
+        const uint8_t *prev = nullptr;
+        for (size_t pos = 0; pos < lexicon.size(); pos += token_slot) {
+            const uint8_t *token = &lexicon[pos];
+            size_t shared = 0;
+            if (prev != nullptr) {
+                size_t limit = std::min(token_size(prev), token_size(token));
+                while (shared < limit && prev[shared] == token[shared]) shared++;
+            }
+            bytes.push_back(shared << 4 | (token_size(token) - shared));
+            bytes.insert(bytes.end(), token + shared, token + token_size(token));
+            prev = token;
+        }
+        scratch.freq.assign(byte_alphabet, 0);
+        for (uint8_t byte : bytes) scratch.freq[byte]++;
+        package_merge(scratch.freq, DecodeTable::root_bits, scratch.lengths, scratch.merge);
+        canonical_codes(scratch.lengths, scratch.codes);
+        write_code_lengths(out, scratch.lengths);
+        BitWriter bits(out);
+        for (uint8_t byte : bytes) bits.put(scratch.codes[byte], scratch.lengths[byte]);
+        bits.finish();
+    }
+
+    void read_lexicon(const uint8_t *data, size_t size, size_t count, std::vector<uint8_t> &lexicon, LexiconScratch &scratch) {
+        ByteReader in(data, size);
+        read_code_lengths(in, byte_alphabet, scratch.lengths);
+        for (uint8_t len : scratch.lengths) {
+            if (len > DecodeTable::root_bits) throw std::ios_base::failure("Invalid lexicon");
+        }
+        scratch.table.build(scratch.lengths);
+        BitReader bits(in);
+        auto next = [&bits, &scratch]() {
+            bits.refill();
+            uint32_t entry = scratch.table[bits.peek(DecodeTable::root_bits)];
+            int len = DecodeTable::length(entry);
+            if (len == 0 || len > bits.available()) throw std::ios_base::failure("Invalid lexicon");
+            bits.consume(len);
+            return uint8_t(DecodeTable::value(entry));
+        };
+        lexicon.assign(count * token_slot, 0);
+        for (size_t i = 0; i < count; i++) {
+            uint8_t sizes = next();
+            size_t shared = sizes >> 4, rest = sizes & 0xF;
+            uint8_t *token = &lexicon[i * token_slot];
+            if (rest == 0 || shared + rest > max_token_size || (i == 0 ? shared != 0 : shared > token_size(token - token_slot))) {
+                throw std::ios_base::failure("Invalid lexicon");
+            }
+            if (shared != 0) std::memcpy(token, token - token_slot, shared);
+            for (size_t pos = shared; pos < shared + rest; pos++) token[pos] = next();
+            token[max_token_size] = shared + rest;
+        }
+    }
+}
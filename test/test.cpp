@@ -1,6 +1,18 @@
 #define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
 #include "doctest.h"
 #include "huffman.h"
+#include "code_table.h"
+#include "bit_io.h"
+#include "histogram.h"
+#include "dictionary.h"
+#include "context_model.h"
+#include "token_model.h"
+#include "symbol_model.h"
+#include <sstream>
+#include <chrono>
+#include <atomic>
+#include <cstdlib>
+#include <filesystem>
 
 bool check_files(const std::string &filename1, const std::string &filename2) {
     std::ifstream in1(filename1);
@@ -21,7 +33,7 @@ bool check_files(const std::string &filename1, const std::string &filename2) {
 }
 
 TEST_CASE("huffman tree tests") {
-    std::vector<int> freq(1 << CHAR_BIT);
+    std::vector<uint64_t> freq(1 << CHAR_BIT);
 
     SUBCASE("empty huffman tree test") {
         huffman::HuffTree tree = huffman::HuffTree(freq);
@@ -31,7 +43,7 @@ TEST_CASE("huffman tree tests") {
     freq[uint8_t('a')] = 1;
     SUBCASE("one symbol tree test") {
         huffman::HuffTree tree = huffman::HuffTree(freq);
-        huffman::TreeNode *root = tree.get_root();
+        const huffman::TreeNode *root = tree.get_root();
         CHECK_EQ('a', root->ch);
         CHECK_EQ(1, root->val);
     }
@@ -41,23 +53,41 @@ TEST_CASE("huffman tree tests") {
     freq[uint8_t('d')] = 8;
     SUBCASE("ordinary huffman tree test") {
         huffman::HuffTree tree = huffman::HuffTree(freq);
-        huffman::TreeNode *cur_node = tree.get_root();
+        const huffman::TreeNode *cur_node = tree.get_root();
         CHECK_EQ(15, cur_node->val);
-        CHECK_EQ('d', cur_node->right->ch);
-        CHECK_EQ(8, cur_node->right->val);
-        cur_node = cur_node->left.get();
+        CHECK_EQ('d', tree.get_right(cur_node)->ch);
+        CHECK_EQ(8, tree.get_right(cur_node)->val);
+        cur_node = tree.get_left(cur_node);
         CHECK_EQ(7, cur_node->val);
-        CHECK_EQ('c', cur_node->right->ch);
-        CHECK_EQ(4, cur_node->right->val);
-        cur_node = cur_node->left.get();
+        CHECK_EQ('c', tree.get_right(cur_node)->ch);
+        CHECK_EQ(4, tree.get_right(cur_node)->val);
+        cur_node = tree.get_left(cur_node);
         CHECK_EQ(3, cur_node->val);
-        CHECK_EQ('b', cur_node->right->ch);
-        CHECK_EQ(2, cur_node->right->val);
-        CHECK_EQ('a', cur_node->left->ch);
-        CHECK_EQ(1, cur_node->left->val);
+        CHECK_EQ('b', tree.get_right(cur_node)->ch);
+        CHECK_EQ(2, tree.get_right(cur_node)->val);
+        CHECK_EQ('a', tree.get_left(cur_node)->ch);
+        CHECK_EQ(1, tree.get_left(cur_node)->val);
+        CHECK(tree.get_left(cur_node)->is_leaf());
     }
 }
 
+TEST_CASE("huffman tree tie-breaking") {
+    std::vector<uint64_t> freq(1 << CHAR_BIT);
+    for (char ch : {'e', 'b', 'd', 'a', 'c'}) freq[uint8_t(ch)] = 5;
+
+    huffman::HuffTree tree(freq);
+    const huffman::TreeNode *root = tree.get_root();
+    CHECK_EQ(25, root->val);
+    const huffman::TreeNode *left = tree.get_left(root), *right = tree.get_right(root);
+    CHECK_EQ(10, left->val);
+    CHECK_EQ('c', tree.get_left(left)->ch);
+    CHECK_EQ('d', tree.get_right(left)->ch);
+    CHECK_EQ(15, right->val);
+    CHECK_EQ('e', tree.get_left(right)->ch);
+    CHECK_EQ('a', tree.get_left(tree.get_right(right))->ch);
+    CHECK_EQ('b', tree.get_right(tree.get_right(right))->ch);
+}
+
 TEST_CASE("huffman archiver tests") {
     std::string zipped = "out.bin", unzipped = "out.txt";
     huffman::HuffmanArchiver archiver, dearchiver;
@@ -152,3 +182,1166 @@ TEST_CASE("huffman archiver tests") {
         CHECK_EQ(stats1.additionalData, stats2.additionalData);
     }
 }
+
+TEST_CASE("table decoder matches tree walker") {
+    std::string zipped = "out.bin", unzipped = "out.txt", reference = "out.ref";
+    for (const char *file : {"data/empty.txt", "data/OneSymbolFile.txt", "data/AStudyInScarlet.txt", "data/file.bin", "data/EveryChar.bin"}) {
+        CAPTURE(file);
+        huffman::HuffmanArchiver archiver;
+        archiver.set_streams(1);
+        std::ifstream in(file);
+        std::ofstream out(zipped);
+        archiver.zip(in, out);
+        in.close();
+        out.close();
+
+        std::ifstream fin(zipped);
+        std::ofstream fout(unzipped);
+        huffman::StatHandler stats1 = archiver.unzip(fin, fout);
+        fin.close();
+        fout.close();
+
+        std::ifstream rin(zipped);
+        std::ofstream rout(reference);
+        huffman::ByteReader reader(rin.rdbuf(), 1 << 12);
+        huffman::ByteWriter writer(rout.rdbuf(), 1 << 12);
+        uint64_t body = huffman::read_varint(reader);
+        uint8_t streams;
+        if (body != 0) reader.read_exact(&streams, sizeof(uint8_t));
+        if (body == 0) continue;
+        REQUIRE_EQ(1, streams);
+        uint64_t cnt;
+        huffman::HuffTree tree = huffman::HuffTree::extract(reader, cnt);
+        huffman::StatHandler stats2 = tree.decode_reference(reader, writer, cnt);
+        stats2.additionalData += huffman::varint_size(0);
+        writer.flush();
+        rin.close();
+        rout.close();
+
+        CHECK(check_files(file, unzipped));
+        CHECK(check_files(reference, unzipped));
+        CHECK_EQ(stats1.inputData, stats2.inputData);
+        CHECK_EQ(stats1.outputData, stats2.outputData);
+        CHECK_EQ(stats1.additionalData, stats2.additionalData);
+    }
+}
+
+TEST_CASE("table decoder with codes longer than the lookup table") {
+    std::string zipped = "out.bin", unzipped = "out.txt", source = "out.src";
+    std::vector<int> fib = {1, 1};
+    while (fib.size() < 26) fib.push_back(fib[fib.size() - 1] + fib[fib.size() - 2]);
+    {
+        std::ofstream src(source);
+        for (int i = 0; i < (int)fib.size(); i++) {
+            for (int j = 0; j < fib[i]; j++) src.put(char('A' + i));
+        }
+    }
+    for (int max_length : {11, 15, 32}) {
+        CAPTURE(max_length);
+        huffman::HuffmanArchiver archiver, dearchiver;
+        archiver.set_max_code_length(max_length);
+        std::ifstream in(source);
+        std::ofstream out(zipped);
+        archiver.zip(in, out);
+        in.close();
+        out.close();
+        std::ifstream fin(zipped);
+        std::ofstream fout(unzipped);
+        dearchiver.unzip(fin, fout);
+        fin.close();
+        fout.close();
+        CHECK(check_files(source, unzipped));
+    }
+}
+
+TEST_CASE("canonical codes") {
+    std::vector<uint64_t> freq(1 << CHAR_BIT);
+    freq[uint8_t('a')] = 1;
+    freq[uint8_t('b')] = 2;
+    freq[uint8_t('c')] = 4;
+    freq[uint8_t('d')] = 8;
+    huffman::HuffTree tree(freq);
+    std::vector<uint8_t> lengths = tree.code_lengths();
+    CHECK_EQ(3, lengths[uint8_t('a')]);
+    CHECK_EQ(3, lengths[uint8_t('b')]);
+    CHECK_EQ(2, lengths[uint8_t('c')]);
+    CHECK_EQ(1, lengths[uint8_t('d')]);
+
+    std::vector<uint64_t> codes = huffman::canonical_codes(lengths);
+    CHECK_EQ(0b110, codes[uint8_t('a')]);
+    CHECK_EQ(0b111, codes[uint8_t('b')]);
+    CHECK_EQ(0b10, codes[uint8_t('c')]);
+    CHECK_EQ(0b0, codes[uint8_t('d')]);
+
+    huffman::HuffTree canonical = huffman::HuffTree::canonical(lengths);
+    const huffman::TreeNode *root = canonical.get_root();
+    CHECK_EQ('d', canonical.get_left(root)->ch);
+    CHECK_EQ('c', canonical.get_left(canonical.get_right(root))->ch);
+    const huffman::TreeNode *deepest = canonical.get_right(canonical.get_right(root));
+    CHECK_EQ('a', canonical.get_left(deepest)->ch);
+    CHECK_EQ('b', canonical.get_right(deepest)->ch);
+}
+
+TEST_CASE("code lengths header") {
+    std::stringstream stream;
+    huffman::ByteWriter out(stream.rdbuf(), 1 << 12);
+    huffman::ByteReader in(stream.rdbuf(), 1 << 12);
+
+    SUBCASE("sparse header stores a symbol and a length nibble per present symbol") {
+        std::vector<uint8_t> lengths(1 << CHAR_BIT);
+        lengths[uint8_t('x')] = 1;
+        lengths[uint8_t('y')] = 2;
+        lengths[uint8_t('z')] = 2;
+        huffman::write_code_lengths(out, lengths);
+        out.flush();
+        CHECK_EQ(2 + 1 + 3 + 2, out.position());
+        CHECK(lengths == huffman::read_code_lengths(in, 1 << CHAR_BIT));
+    }
+
+    SUBCASE("dense header stores a bitmap") {
+        std::vector<uint8_t> lengths(1 << CHAR_BIT, 8);
+        huffman::write_code_lengths(out, lengths);
+        out.flush();
+        CHECK_EQ(2 + 1 + 32 + 128, out.position());
+        CHECK(lengths == huffman::read_code_lengths(in, 1 << CHAR_BIT));
+    }
+
+    SUBCASE("incomplete code is rejected") {
+        std::vector<uint8_t> lengths(1 << CHAR_BIT);
+        lengths[0] = 1;
+        lengths[1] = 2;
+        huffman::write_code_lengths(out, lengths);
+        out.flush();
+        CHECK_THROWS_AS(huffman::read_code_lengths(in, 1 << CHAR_BIT), std::ios_base::failure);
+    }
+
+    SUBCASE("truncated header is rejected") {
+        std::vector<uint8_t> lengths(1 << CHAR_BIT, 8);
+        huffman::write_code_lengths(out, lengths);
+        out.flush();
+        std::stringstream truncated(stream.str().substr(0, 40));
+        huffman::ByteReader short_in(truncated.rdbuf(), 1 << 12);
+        CHECK_THROWS_AS(huffman::read_code_lengths(short_in, 1 << CHAR_BIT), std::ios_base::failure);
+    }
+}
+
+TEST_CASE("length-limited code lengths") {
+    std::vector<uint64_t> freq(1 << CHAR_BIT);
+    freq[0] = freq[1] = 1;
+    for (int ch = 2; ch < 40; ch++) freq[ch] = std::min(freq[ch - 1] + freq[ch - 2], uint64_t(1) << 28);
+    huffman::HuffTree tree(freq);
+    std::vector<uint8_t> unlimited = tree.code_lengths();
+    CHECK_GT(*std::max_element(unlimited.begin(), unlimited.end()), 32);
+
+    auto cost = [&freq](const std::vector<uint8_t> &lengths) {
+        uint64_t bits = 0;
+        for (size_t ch = 0; ch < freq.size(); ch++) bits += (uint64_t)freq[ch] * lengths[ch];
+        return bits;
+    };
+    SUBCASE("package-merge without an effective limit is optimal") {
+        CHECK_EQ(cost(unlimited), cost(huffman::package_merge(freq, 63)));
+    }
+    for (int max_length : {6, 11, 12, 15}) {
+        CAPTURE(max_length);
+        std::vector<uint8_t> lengths = tree.code_lengths(max_length);
+        CHECK_EQ(max_length, *std::max_element(lengths.begin(), lengths.end()));
+        CHECK_GE(cost(lengths), cost(unlimited));
+        uint64_t kraft = 0;
+        for (uint8_t len : lengths) {
+            if (len != 0) kraft += uint64_t(1) << (63 - len);
+        }
+        CHECK_EQ(uint64_t(1) << 63, kraft);
+    }
+    SUBCASE("limit below log2 of the alphabet is raised") {
+        std::vector<uint8_t> lengths = tree.code_lengths(3);
+        CHECK_EQ(6, *std::max_element(lengths.begin(), lengths.end()));
+    }
+    SUBCASE("invalid limit is rejected") {
+        huffman::HuffmanArchiver archiver;
+        CHECK_THROWS_AS(archiver.set_max_code_length(0), std::invalid_argument);
+        CHECK_THROWS_AS(archiver.set_max_code_length(33), std::invalid_argument);
+    }
+}
+
+TEST_CASE("bit writer packs MSB-first across word boundaries") {
+    std::stringstream stream;
+    std::vector<bool> expected;
+    {
+        huffman::ByteWriter bytes(stream.rdbuf(), 1 << 12);
+        huffman::BitWriter writer(bytes);
+        uint64_t state = 12345;
+        for (int i = 0; i < 1000; i++) {
+            state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+            int len = int(state >> 59) + 1;
+            uint32_t code = uint32_t(state >> 16) & uint32_t((uint64_t(1) << len) - 1);
+            writer.put(code, len);
+            for (int j = len - 1; j >= 0; j--) expected.push_back((code >> j) & 1);
+        }
+        writer.finish();
+        bytes.flush();
+    }
+    std::string bytes = stream.str();
+    REQUIRE_EQ((expected.size() + 7) / 8, bytes.size());
+    std::vector<bool> actual;
+    for (size_t i = 0; i < expected.size(); i++) actual.push_back((uint8_t(bytes[i / 8]) >> (7 - i % 8)) & 1);
+    CHECK(expected == actual);
+}
+
+TEST_CASE("memory-mapped zip and unzip") {
+    std::string zipped = "out.bin", unzipped = "out.txt", mapped_zipped = "out.map.bin", mapped_unzipped = "out.map.txt";
+    for (const char *file : {"data/empty.txt", "data/OneSymbolFile.txt", "data/AStudyInScarlet.txt", "data/file.bin", "data/EveryChar.bin"}) {
+        CAPTURE(file);
+        huffman::HuffmanArchiver archiver;
+        std::ifstream in(file);
+        std::ofstream out(zipped);
+        huffman::StatHandler stream_stats = archiver.zip(in, out);
+        in.close();
+        out.close();
+
+        huffman::StatHandler zip_stats = archiver.zip_file(file, mapped_zipped);
+        CHECK(check_files(zipped, mapped_zipped));
+        CHECK_EQ(stream_stats.inputData, zip_stats.inputData);
+        CHECK_EQ(stream_stats.outputData, zip_stats.outputData);
+        CHECK_EQ(stream_stats.additionalData, zip_stats.additionalData);
+
+        huffman::StatHandler unzip_stats = archiver.unzip_file(mapped_zipped, mapped_unzipped);
+        CHECK(check_files(file, mapped_unzipped));
+        CHECK_EQ(zip_stats.inputData, unzip_stats.outputData);
+        CHECK_EQ(zip_stats.outputData, unzip_stats.inputData);
+        CHECK_EQ(zip_stats.additionalData, unzip_stats.additionalData);
+    }
+}
+
+TEST_CASE("interleaved sub-streams") {
+    std::string zipped = "out.bin", unzipped = "out.txt", mapped = "out.map.txt";
+    for (const char *file : {"data/empty.txt", "data/OneSymbolFile.txt", "data/AStudyInScarlet.txt", "data/file.bin", "data/EveryChar.bin"}) {
+        for (int streams = 1; streams <= huffman::HuffmanArchiver::max_streams; streams++) {
+            CAPTURE(file);
+            CAPTURE(streams);
+            huffman::HuffmanArchiver archiver, dearchiver;
+            archiver.set_streams(streams);
+            std::ifstream in(file);
+            std::ofstream out(zipped);
+            huffman::StatHandler stats1 = archiver.zip(in, out);
+            in.close();
+            out.close();
+            std::ifstream fin(zipped);
+            std::ofstream fout(unzipped);
+            huffman::StatHandler stats2 = dearchiver.unzip(fin, fout);
+            fin.close();
+            fout.close();
+            CHECK(check_files(file, unzipped));
+            CHECK_EQ(stats1.inputData, stats2.outputData);
+            CHECK_EQ(stats1.outputData, stats2.inputData);
+            CHECK_EQ(stats1.additionalData, stats2.additionalData);
+
+            dearchiver.unzip_file(zipped, mapped);
+            CHECK(check_files(file, mapped));
+        }
+    }
+    huffman::HuffmanArchiver archiver;
+    CHECK_THROWS_AS(archiver.set_streams(0), std::invalid_argument);
+    CHECK_THROWS_AS(archiver.set_streams(huffman::HuffmanArchiver::max_streams + 1), std::invalid_argument);
+}
+
+TEST_CASE("block-parallel zip and unzip") {
+    std::string zipped = "out.bin", unzipped = "out.txt", source = "out.src", reference = "out.ref", mapped = "out.map.bin";
+    {
+        // Blocks with different statistics: text, a run of a single byte and every byte value.
+        std::ifstream text("data/AStudyInScarlet.txt");
+        std::ofstream src(source);
+        src << text.rdbuf();
+        src << std::string(10000, 'z');
+        for (int i = 0; i < 5000; i++) src.put(char(i * 7));
+    }
+    huffman::HuffmanArchiver single;
+    single.set_block_size(huffman::HuffmanArchiver::min_block_size);
+    {
+        std::ifstream in(source);
+        std::ofstream out(reference);
+        single.zip(in, out);
+    }
+    for (int threads : {1, 2, 3, 8}) {
+        CAPTURE(threads);
+        huffman::HuffmanArchiver archiver, dearchiver;
+        archiver.set_block_size(huffman::HuffmanArchiver::min_block_size);
+        archiver.set_threads(threads);
+        dearchiver.set_threads(threads);
+        std::ifstream in(source);
+        std::ofstream out(zipped);
+        huffman::StatHandler stats1 = archiver.zip(in, out);
+        in.close();
+        out.close();
+        CHECK(check_files(reference, zipped));
+
+        std::ifstream fin(zipped);
+        std::ofstream fout(unzipped);
+        huffman::StatHandler stats2 = dearchiver.unzip(fin, fout);
+        fin.close();
+        fout.close();
+        CHECK(check_files(source, unzipped));
+        CHECK_EQ(stats1.inputData, stats2.outputData);
+        CHECK_EQ(stats1.outputData, stats2.inputData);
+        CHECK_EQ(stats1.additionalData, stats2.additionalData);
+
+        huffman::StatHandler stats3 = archiver.zip_file(source, mapped);
+        CHECK(check_files(reference, mapped));
+        CHECK_EQ(stats1.additionalData, stats3.additionalData);
+        dearchiver.unzip_file(mapped, unzipped);
+        CHECK(check_files(source, unzipped));
+    }
+    {
+        // A single block larger than a histogram slice is counted across the pool.
+        huffman::HuffmanArchiver sequential, parallel;
+        parallel.set_threads(4);
+        sequential.zip_file(source, reference);
+        parallel.zip_file(source, mapped);
+        CHECK(check_files(reference, mapped));
+        single.zip_file(source, reference);
+    }
+    {
+        // An archive cut before its end marker is rejected.
+        std::ifstream in(reference);
+        std::string data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        std::ofstream out(zipped);
+        out << data.substr(0, data.size() - huffman::varint_size(0));
+    }
+    std::ifstream fin(zipped);
+    std::ofstream fout(unzipped);
+    CHECK_THROWS_AS(single.unzip(fin, fout), std::ios_base::failure);
+    CHECK_THROWS_AS(single.set_block_size(huffman::HuffmanArchiver::min_block_size - 1), std::invalid_argument);
+    CHECK_THROWS_AS(single.set_block_size(huffman::HuffmanArchiver::max_block_size + 1), std::invalid_argument);
+    CHECK_THROWS_AS(single.set_threads(0), std::invalid_argument);
+    CHECK_THROWS_AS(single.set_threads(huffman::HuffmanArchiver::max_threads + 1), std::invalid_argument);
+}
+
+TEST_CASE("banked histogram matches a plain count") {
+    std::vector<uint8_t> data(300000);
+    uint32_t state = 12345;
+    for (uint8_t &byte : data) {
+        state = state * 1103515245 + 12345;
+        byte = uint8_t(state >> 24);
+    }
+    std::vector<uint8_t> run(300000, 'a');
+    for (const std::vector<uint8_t> *input : {&data, &run}) {
+        for (size_t size : {0, 1, 15, 16, 17, 31, 1000, 4097, 99000, 250000}) {
+            for (size_t offset : {0, 3}) {
+                CAPTURE(size);
+                CAPTURE(offset);
+                std::vector<uint64_t> expected(256), actual(256, 1);
+                for (size_t i = 0; i < size; i++) expected[(*input)[offset + i]]++;
+                for (uint64_t &cnt : expected) cnt++;
+                std::vector<uint64_t> parallel = actual;
+                huffman::count_frequencies(input->data() + offset, size, actual);
+                CHECK_EQ(expected, actual);
+                huffman::ThreadPool pool(3);
+                huffman::count_frequencies(input->data() + offset, size, parallel, pool, 3);
+                CHECK_EQ(expected, parallel);
+            }
+        }
+    }
+}
+
+// Read-only stream buffer over a string that, like a pipe, cannot seek.
+class PipeBuffer : public std::streambuf {
+private:
+    std::string data;
+public:
+    explicit PipeBuffer(std::string str) : data(std::move(str)) {
+        setg(data.data(), data.data(), data.data() + data.size());
+    }
+};
+
+TEST_CASE("zip and unzip through non-seekable streams") {
+    for (const char *file : {"data/empty.txt", "data/OneSymbolFile.txt", "data/AStudyInScarlet.txt", "data/EveryChar.bin"}) {
+        CAPTURE(file);
+        std::ifstream in(file);
+        std::string source((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        huffman::HuffmanArchiver archiver;
+        archiver.set_block_size(huffman::HuffmanArchiver::min_block_size);
+
+        PipeBuffer zip_input(source);
+        std::istream zip_stream(&zip_input);
+        std::ostringstream zipped;
+        huffman::StatHandler stats1 = archiver.zip(zip_stream, zipped);
+
+        PipeBuffer unzip_input(zipped.str());
+        std::istream unzip_stream(&unzip_input);
+        std::ostringstream unzipped;
+        huffman::StatHandler stats2 = archiver.unzip(unzip_stream, unzipped);
+        CHECK_EQ(source, unzipped.str());
+        CHECK_EQ(stats1.inputData, source.size());
+        CHECK_EQ(stats1.inputData, stats2.outputData);
+        CHECK_EQ(stats1.outputData, stats2.inputData);
+        CHECK_EQ(stats1.additionalData, stats2.additionalData);
+    }
+}
+
+TEST_CASE("varint sizes") {
+    for (uint64_t value : {uint64_t(0), uint64_t(1), uint64_t(127), uint64_t(128), uint64_t(300), uint64_t(1) << 35, UINT64_MAX}) {
+        CAPTURE(value);
+        std::stringstream data;
+        huffman::ByteWriter writer(data.rdbuf(), 1 << 12);
+        huffman::write_varint(writer, value);
+        writer.flush();
+        CHECK_EQ(writer.position(), huffman::varint_size(value));
+        huffman::ByteReader reader(data.rdbuf(), 1 << 12);
+        CHECK_EQ(huffman::read_varint(reader), value);
+    }
+    CHECK_EQ(huffman::varint_size(UINT64_MAX), huffman::max_varint_size);
+    for (const std::string &bad : {std::string("\x80\x80"), std::string(10, '\xff') + "\x01"}) {
+        huffman::ByteReader reader((const uint8_t *)bad.data(), bad.size());
+        CHECK_THROWS_AS(huffman::read_varint(reader), std::ios_base::failure);
+    }
+}
+
+TEST_CASE("adaptive zip and unzip") {
+    std::string zipped = "out.bin", unzipped = "out.txt", mapped_zipped = "out.map.bin", mapped_unzipped = "out.map.txt";
+    for (const char *file : {"data/empty.txt", "data/OneSymbolFile.txt", "data/AStudyInScarlet.txt", "data/file.bin", "data/EveryChar.bin"}) {
+        CAPTURE(file);
+        huffman::HuffmanArchiver archiver, dearchiver;
+        archiver.set_adaptive(true);
+        std::ifstream in(file);
+        std::ofstream out(zipped);
+        huffman::StatHandler stats1 = archiver.zip(in, out);
+        in.close();
+        out.close();
+        std::ifstream fin(zipped);
+        std::ofstream fout(unzipped);
+        huffman::StatHandler stats2 = dearchiver.unzip(fin, fout);
+        fin.close();
+        fout.close();
+        CHECK(check_files(file, unzipped));
+        CHECK_EQ(stats1.inputData, stats2.outputData);
+        CHECK_EQ(stats1.outputData, stats2.inputData);
+        CHECK_EQ(stats1.additionalData, stats2.additionalData);
+
+        huffman::StatHandler stats3 = archiver.zip_file(file, mapped_zipped);
+        CHECK(check_files(zipped, mapped_zipped));
+        CHECK_EQ(stats1.additionalData, stats3.additionalData);
+        huffman::StatHandler stats4 = dearchiver.unzip_file(mapped_zipped, mapped_unzipped);
+        CHECK(check_files(file, mapped_unzipped));
+        CHECK_EQ(stats2.additionalData, stats4.additionalData);
+    }
+    {
+        // A short message costs a few framing bytes instead of a code lengths header.
+        huffman::HuffmanArchiver archiver, adaptive;
+        adaptive.set_adaptive(true);
+        huffman::StatHandler stats1 = archiver.zip_file("data/file.bin", zipped);
+        huffman::StatHandler stats2 = adaptive.zip_file("data/file.bin", mapped_zipped);
+        CHECK_LT(stats2.additionalData, 8);
+        CHECK_LT(stats2.additionalData + stats2.outputData, stats1.additionalData + stats1.outputData);
+    }
+    {
+        // Compression catches up with the static code on longer inputs.
+        huffman::HuffmanArchiver archiver, adaptive;
+        adaptive.set_adaptive(true);
+        huffman::StatHandler stats1 = archiver.zip_file("data/AStudyInScarlet.txt", zipped);
+        huffman::StatHandler stats2 = adaptive.zip_file("data/AStudyInScarlet.txt", mapped_zipped);
+        CHECK_LT(stats2.outputData + stats2.additionalData, (stats1.outputData + stats1.additionalData) * 21 / 20);
+    }
+}
+
+TEST_CASE("indexed archives and range decoding") {
+    std::string indexed = "out.bin", plain = "out.ref", unzipped = "out.txt", mapped = "out.map.bin";
+    std::ifstream text("data/AStudyInScarlet.txt");
+    std::string source((std::istreambuf_iterator<char>(text)), std::istreambuf_iterator<char>());
+    huffman::HuffmanArchiver archiver;
+    archiver.set_block_size(huffman::HuffmanArchiver::min_block_size);
+    archiver.zip_file("data/AStudyInScarlet.txt", plain);
+    archiver.set_index(true);
+    huffman::StatHandler stats1;
+    {
+        std::ifstream in("data/AStudyInScarlet.txt");
+        std::ofstream out(indexed);
+        stats1 = archiver.zip(in, out);
+    }
+    huffman::StatHandler stats2 = archiver.zip_file("data/AStudyInScarlet.txt", mapped);
+    CHECK(check_files(indexed, mapped));
+    CHECK_EQ(stats1.outputData, stats2.outputData);
+    CHECK_EQ(stats1.additionalData, stats2.additionalData);
+
+    // Indexed archives stay readable by the whole-archive decoders.
+    {
+        std::ifstream in(indexed);
+        std::ofstream out(unzipped);
+        huffman::StatHandler stats3 = archiver.unzip(in, out);
+        CHECK_EQ(stats1.additionalData, stats3.additionalData);
+        CHECK_EQ(stats1.outputData, stats3.inputData);
+    }
+    CHECK(check_files("data/AStudyInScarlet.txt", unzipped));
+    huffman::StatHandler stats4 = archiver.unzip_file(indexed, unzipped);
+    CHECK(check_files("data/AStudyInScarlet.txt", unzipped));
+    CHECK_EQ(stats1.additionalData, stats4.additionalData);
+
+    std::vector<std::pair<uint64_t, uint64_t>> ranges = {{0, 0}, {0, 1}, {0, 4096}, {4095, 2}, {100000, 50000}, {source.size() - 10, 10}, {0, source.size()}};
+    for (const std::string &archive : {indexed, plain}) {
+        for (int threads : {1, 3}) {
+            for (auto [start, length] : ranges) {
+                CAPTURE(archive);
+                CAPTURE(start);
+                CAPTURE(length);
+                huffman::HuffmanArchiver reader;
+                reader.set_threads(threads);
+                std::ostringstream out;
+                huffman::StatHandler stats = reader.unzip_range(archive, out, start, length);
+                CHECK_EQ(out.str(), source.substr(start, length));
+                CHECK_EQ(stats.outputData, length);
+                if (length > 0 && length < 10000) CHECK_LT(stats.inputData, 3 * huffman::HuffmanArchiver::min_block_size);
+            }
+            std::ostringstream out;
+            CHECK_THROWS_AS(archiver.unzip_range(archive, out, source.size(), 1), std::invalid_argument);
+            CHECK_THROWS_AS(archiver.unzip_range(archive, out, 1, UINT64_MAX), std::invalid_argument);
+        }
+    }
+
+    // Frame sizes that wrap around 2^64 to the size of the frames must not pass for a valid index.
+    {
+        std::ifstream in(plain, std::ios::binary);
+        std::vector<uint8_t> crafted((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>()), index;
+        huffman::ByteWriter writer(index);
+        huffman::write_varint(writer, 2);
+        for (uint64_t frame_size : {uint64_t(1) << 63, (uint64_t(1) << 63) + crafted.size() - 1}) {
+            huffman::write_varint(writer, 1);
+            huffman::write_varint(writer, frame_size);
+        }
+        uint64_t index_size = writer.position();
+        writer.write(&index_size, sizeof(uint64_t));
+        writer.write("HIDX", 4);
+        writer.flush();
+        crafted.insert(crafted.end(), index.begin(), index.end());
+        std::ofstream out(mapped, std::ios::binary);
+        out.write(reinterpret_cast<const char *>(crafted.data()), crafted.size());
+    }
+    std::ostringstream crafted_out;
+    CHECK_THROWS_AS(archiver.unzip_range(mapped, crafted_out, 1, 1), std::ios_base::failure);
+
+    // A block that fails to decode is reported while the blocks after it are still being decoded.
+    {
+        std::ifstream in(indexed, std::ios::binary);
+        std::vector<uint8_t> damaged((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        huffman::ByteReader reader(damaged.data(), damaged.size());
+        uint64_t body_size = read_varint(reader), frame_end = reader.position() + body_size;
+        std::fill(damaged.begin() + frame_end - body_size / 2, damaged.begin() + frame_end, 0xFF);
+        std::ofstream out(mapped, std::ios::binary);
+        out.write(reinterpret_cast<const char *>(damaged.data()), damaged.size());
+    }
+    for (int threads : {1, 3}) {
+        huffman::HuffmanArchiver reader;
+        reader.set_threads(threads);
+        std::ostringstream damaged_out;
+        CHECK_THROWS_AS(reader.unzip_range(mapped, damaged_out, 0, 20000), std::ios_base::failure);
+    }
+
+    archiver.set_adaptive(true);
+    std::ifstream in("data/AStudyInScarlet.txt");
+    std::ofstream out(indexed);
+    CHECK_THROWS_AS(archiver.zip(in, out), std::invalid_argument);
+}
+
+TEST_CASE("phase timings") {
+    std::ifstream text("data/AStudyInScarlet.txt");
+    std::string source((std::istreambuf_iterator<char>(text)), std::istreambuf_iterator<char>());
+    auto sum = [](const huffman::PhaseTimes &time) {
+        return time.histogram + time.tree + time.table + time.coding + time.io;
+    };
+    for (bool adaptive : {false, true}) {
+        CAPTURE(adaptive);
+        huffman::HuffmanArchiver archiver;
+        archiver.set_adaptive(adaptive);
+        std::istringstream in(source);
+        std::ostringstream zipped;
+        auto started = std::chrono::steady_clock::now();
+        huffman::StatHandler stats1 = archiver.zip(in, zipped);
+        uint64_t elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - started).count();
+        CHECK_GT(stats1.time.histogram, 0);
+        CHECK_GT(stats1.time.tree, 0);
+        CHECK_GT(stats1.time.table, 0);
+        CHECK_GT(stats1.time.coding, 0);
+        CHECK_GT(stats1.time.io, 0);
+        // With a single thread the phases do not overlap.
+        CHECK_LE(sum(stats1.time), elapsed);
+
+        std::istringstream archive(zipped.str());
+        std::ostringstream unzipped;
+        huffman::StatHandler stats2 = archiver.unzip(archive, unzipped);
+        CHECK_EQ(unzipped.str(), source);
+        CHECK_GT(stats2.time.table, 0);
+        CHECK_GT(stats2.time.coding, 0);
+        // Only the adaptive decoder counts symbols and rebuilds the code.
+        CHECK_EQ(stats2.time.histogram > 0, adaptive);
+        CHECK_EQ(stats2.time.tree > 0, adaptive);
+
+        huffman::StatHandler stats3 = archiver.zip_file("data/AStudyInScarlet.txt", "out.map.bin");
+        CHECK_EQ(stats3.inputData, stats1.inputData);
+        CHECK_EQ(stats3.outputData, stats1.outputData);
+        CHECK_EQ(stats3.additionalData, stats1.additionalData);
+        CHECK_GT(stats3.time.io, 0);
+        CHECK_GT(stats3.time.coding, 0);
+    }
+}
+
+TEST_CASE("zip and unzip in memory") {
+    std::string zipped = "out.bin";
+    for (const char *file : {"data/empty.txt", "data/OneSymbolFile.txt", "data/AStudyInScarlet.txt", "data/file.bin", "data/EveryChar.bin"}) {
+        CAPTURE(file);
+        std::ifstream in(file, std::ios::binary);
+        std::vector<uint8_t> source((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        for (bool adaptive : {false, true}) {
+            CAPTURE(adaptive);
+            huffman::HuffmanArchiver archiver;
+            archiver.set_adaptive(adaptive);
+            archiver.set_threads(2);
+            huffman::StatHandler stats1 = archiver.zip_file(file, zipped);
+            std::ifstream archive(zipped, std::ios::binary);
+            std::vector<uint8_t> expected((std::istreambuf_iterator<char>(archive)), std::istreambuf_iterator<char>());
+
+            // The vector sink is resized to the archive, whatever it held before.
+            std::vector<uint8_t> packed(3, 'x'), unpacked(1 << 20, 'x');
+            huffman::StatHandler stats2 = archiver.zip(source.data(), source.size(), packed);
+            CHECK_EQ(packed, expected);
+            CHECK_EQ(stats2.inputData, stats1.inputData);
+            CHECK_EQ(stats2.outputData, stats1.outputData);
+            CHECK_EQ(stats2.additionalData, stats1.additionalData);
+            huffman::StatHandler stats3 = archiver.unzip(packed.data(), packed.size(), unpacked);
+            CHECK_EQ(unpacked, source);
+            CHECK_EQ(stats3.inputData, stats2.outputData);
+            CHECK_EQ(stats3.additionalData, stats2.additionalData);
+
+            std::vector<uint8_t> buffer(packed.size());
+            huffman::StatHandler stats4 = archiver.zip(source.data(), source.size(), buffer.data(), buffer.size());
+            CHECK_EQ(buffer, expected);
+            CHECK_EQ(stats4.outputData + stats4.additionalData, buffer.size());
+            std::vector<uint8_t> restored(source.size() + 1);
+            huffman::StatHandler stats5 = archiver.unzip(buffer.data(), buffer.size(), restored.data(), restored.size());
+            CHECK_EQ(stats5.outputData, source.size());
+            CHECK(std::equal(source.begin(), source.end(), restored.begin()));
+
+            if (!source.empty()) {
+                CHECK_THROWS_AS(archiver.zip(source.data(), source.size(), buffer.data(), buffer.size() - 1), std::ios_base::failure);
+                CHECK_THROWS_AS(archiver.unzip(buffer.data(), buffer.size(), restored.data(), source.size() - 1), std::ios_base::failure);
+                CHECK_THROWS_AS(archiver.unzip(buffer.data(), buffer.size() - 1, unpacked), std::ios_base::failure);
+            }
+        }
+    }
+}
+
+TEST_CASE("shared dictionaries") {
+    std::ifstream in("data/AStudyInScarlet.txt", std::ios::binary);
+    std::vector<uint8_t> text((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    std::vector<uint64_t> freq(256, 0);
+    huffman::count_frequencies(text.data(), text.size() / 2, freq);
+    huffman::Dictionary trained = huffman::Dictionary::train(freq, 12);
+    for (int ch = 0; ch < 256; ch++) {
+        CHECK(trained.code_lengths()[ch] >= 1);
+        CHECK(trained.code_lengths()[ch] <= 12);
+        CHECK_EQ(trained.encode_table()[ch].length, trained.code_lengths()[ch]);
+    }
+    CHECK_THROWS_AS(huffman::Dictionary::train(freq, 7), std::invalid_argument);
+    CHECK_THROWS_AS(huffman::Dictionary::train(freq, huffman::Dictionary::max_code_length + 1), std::invalid_argument);
+    CHECK_THROWS_AS(huffman::Dictionary::train(std::vector<uint64_t>(255, 1), 12), std::invalid_argument);
+
+    std::string path = "out.dict";
+    trained.save(path);
+    auto dictionary = std::make_shared<const huffman::Dictionary>(huffman::Dictionary::load(path));
+    CHECK_EQ(dictionary->id(), trained.id());
+    CHECK(std::equal(trained.code_lengths(), trained.code_lengths() + 256, dictionary->code_lengths()));
+
+    std::vector<uint64_t> other_freq(256, 1);
+    auto other = std::make_shared<const huffman::Dictionary>(huffman::Dictionary::train(other_freq, 8));
+    CHECK_NE(other->id(), dictionary->id());
+
+    // Messages from the half of the text the dictionary was not trained on.
+    for (size_t size : {1, 40, 300, 5000, 100000}) {
+        CAPTURE(size);
+        const uint8_t *message = text.data() + text.size() / 2;
+        for (int streams : {1, 4}) {
+            CAPTURE(streams);
+            huffman::HuffmanArchiver plain, shared;
+            plain.set_streams(streams);
+            plain.set_block_size(1 << 16);
+            shared.set_streams(streams);
+            shared.set_block_size(1 << 16);
+            shared.set_dictionary(dictionary);
+            std::vector<uint8_t> packed, reference, unpacked;
+            huffman::StatHandler stats = shared.zip(message, size, packed);
+            plain.zip(message, size, reference);
+            CHECK_EQ(stats.outputData + stats.additionalData, packed.size());
+            if (size >= 40 && size <= 300) CHECK(packed.size() < reference.size());
+            shared.unzip(packed.data(), packed.size(), unpacked);
+            CHECK(std::equal(message, message + size, unpacked.begin(), unpacked.end()));
+
+            std::stringstream source(std::string(message, message + size)), archive, restored;
+            shared.zip(source, archive);
+            CHECK_EQ(archive.str(), std::string(packed.begin(), packed.end()));
+            shared.unzip(archive, restored);
+            CHECK_EQ(restored.str(), std::string(message, message + size));
+
+            CHECK_THROWS_AS(plain.unzip(packed.data(), packed.size(), unpacked), std::ios_base::failure);
+            plain.set_dictionary(other);
+            CHECK_THROWS_AS(plain.unzip(packed.data(), packed.size(), unpacked), std::ios_base::failure);
+        }
+    }
+
+    huffman::HuffmanArchiver adaptive;
+    adaptive.set_adaptive(true);
+    adaptive.set_dictionary(dictionary);
+    std::vector<uint8_t> packed;
+    CHECK_THROWS_AS(adaptive.zip(text.data(), text.size(), packed), std::invalid_argument);
+
+    // A damaged or truncated dictionary file is rejected when it is loaded.
+    std::ifstream saved(path, std::ios::binary);
+    std::vector<uint8_t> image((std::istreambuf_iterator<char>(saved)), std::istreambuf_iterator<char>());
+    saved.close();
+    for (size_t position : {size_t(0), size_t(8), size_t(300), image.size() - 1}) {
+        CAPTURE(position);
+        std::vector<uint8_t> damaged = image;
+        damaged[position] ^= 1;
+        std::ofstream(path, std::ios::binary).write((const char *)damaged.data(), damaged.size());
+        CHECK_THROWS_AS(huffman::Dictionary::load(path), std::ios_base::failure);
+    }
+    std::ofstream(path, std::ios::binary).write((const char *)image.data(), image.size() - 4);
+    CHECK_THROWS_AS(huffman::Dictionary::load(path), std::ios_base::failure);
+}
+
+TEST_CASE("dictionary training over a sample directory") {
+    std::string samples = "out.samples", path = "out.dict";
+    std::filesystem::remove_all(samples);
+    std::filesystem::create_directories(samples + "/nested/deeper");
+    std::filesystem::copy_file("data/AStudyInScarlet.txt", samples + "/text.txt");
+    std::filesystem::copy_file("data/empty.txt", samples + "/nested/empty.txt");
+    std::filesystem::copy_file("data/file.bin", samples + "/nested/file.bin");
+    std::filesystem::copy_file("data/EveryChar.bin", samples + "/nested/deeper/every.bin");
+    std::vector<uint64_t> freq(256, 0);
+    uint64_t total = 0;
+    for (const char *file : {"data/AStudyInScarlet.txt", "data/file.bin", "data/EveryChar.bin"}) {
+        std::ifstream in(file, std::ios::binary);
+        std::vector<uint8_t> data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        huffman::count_frequencies(data.data(), data.size(), freq);
+        total += data.size();
+    }
+    huffman::Dictionary expected = huffman::Dictionary::train(freq, 12);
+
+    // Slices of the minimum block size cut through the files and span the small ones.
+    for (int threads : {1, 3}) {
+        CAPTURE(threads);
+        huffman::HuffmanArchiver archiver;
+        archiver.set_threads(threads);
+        archiver.set_max_code_length(12);
+        archiver.set_block_size(huffman::HuffmanArchiver::min_block_size);
+        huffman::StatHandler stats = archiver.train(samples, path);
+        CHECK_EQ(stats.inputData, total);
+        CHECK_EQ(stats.outputData, std::filesystem::file_size(path));
+        CHECK_EQ(huffman::Dictionary::load(path).id(), expected.id());
+    }
+
+    huffman::HuffmanArchiver archiver;
+    huffman::StatHandler stats = archiver.train("data/AStudyInScarlet.txt", path);
+    CHECK_EQ(stats.inputData, std::filesystem::file_size("data/AStudyInScarlet.txt"));
+    CHECK_THROWS_AS(archiver.train(samples + "/missing", path), std::ios_base::failure);
+    archiver.set_max_code_length(7);
+    CHECK_THROWS_AS(archiver.train(samples, path), std::invalid_argument);
+    archiver.set_max_code_length(huffman::Dictionary::max_code_length + 1);
+    CHECK_THROWS_AS(archiver.train(samples, path), std::invalid_argument);
+    std::filesystem::remove_all(samples);
+}
+
+TEST_CASE("context clustering separates different successors") {
+    std::vector<uint32_t> pairs(1 << 16, 0);
+    pairs['a' << 8 | 'b'] = 100;
+    pairs['c' << 8 | 'b'] = 50;
+    pairs['x' << 8 | 'y'] = 80;
+    pairs['z' << 8 | 'y'] = 40;
+    std::vector<uint8_t> contexts;
+    std::vector<uint64_t> freq;
+    huffman::ClusterScratch scratch;
+    CHECK_EQ(huffman::cluster_contexts(pairs, 2, contexts, freq, scratch), 2);
+    CHECK_EQ(contexts['a'], contexts['c']);
+    CHECK_EQ(contexts['x'], contexts['z']);
+    CHECK_NE(contexts['a'], contexts['x']);
+    CHECK_EQ(freq.size(), 2 * 256);
+    CHECK_EQ(freq[contexts['a'] * 256 + 'b'], 150);
+    CHECK_EQ(freq[contexts['x'] * 256 + 'y'], 120);
+    // Contexts with the same successors end up together even when there is room for more clusters.
+    CHECK_EQ(huffman::cluster_contexts(pairs, 16, contexts, freq, scratch), 2);
+    CHECK_EQ(huffman::cluster_contexts(std::vector<uint32_t>(1 << 16, 0), 16, contexts, freq, scratch), 0);
+}
+
+TEST_CASE("order-1 context modeling") {
+    for (const char *file : {"data/empty.txt", "data/OneSymbolFile.txt", "data/AStudyInScarlet.txt", "data/file.bin", "data/EveryChar.bin"}) {
+        CAPTURE(file);
+        std::ifstream in(file, std::ios::binary);
+        std::vector<uint8_t> source((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        for (int streams : {1, 3, 4, 8}) {
+            CAPTURE(streams);
+            huffman::HuffmanArchiver plain, modeled;
+            for (huffman::HuffmanArchiver *archiver : {&plain, &modeled}) {
+                archiver->set_streams(streams);
+                archiver->set_block_size(1 << 16);
+                archiver->set_threads(2);
+                archiver->set_index(true);
+            }
+            modeled.set_contexts(true);
+            std::vector<uint8_t> reference, packed, unpacked;
+            plain.zip(source.data(), source.size(), reference);
+            huffman::StatHandler stats = modeled.zip(source.data(), source.size(), packed);
+            CHECK(packed.size() <= reference.size());
+            if (std::string(file) == "data/AStudyInScarlet.txt") CHECK(packed.size() < reference.size() * 9 / 10);
+            CHECK_EQ(stats.outputData + stats.additionalData, packed.size());
+            huffman::StatHandler unpacked_stats = plain.unzip(packed.data(), packed.size(), unpacked);
+            CHECK_EQ(unpacked, source);
+            CHECK_EQ(unpacked_stats.additionalData, stats.additionalData);
+
+            std::stringstream input(std::string(source.begin(), source.end())), archive, restored;
+            modeled.zip(input, archive);
+            CHECK_EQ(archive.str(), std::string(packed.begin(), packed.end()));
+            plain.unzip(archive, restored);
+            CHECK_EQ(restored.str(), std::string(source.begin(), source.end()));
+
+            if (source.size() > 100000) {
+                std::ofstream("out.bin", std::ios::binary).write((const char *)packed.data(), packed.size());
+                std::stringstream range;
+                plain.unzip_range("out.bin", range, 70000, 30000);
+                CHECK_EQ(range.str(), std::string(source.begin() + 70000, source.begin() + 100000));
+            }
+        }
+    }
+
+    huffman::HuffmanArchiver adaptive;
+    adaptive.set_adaptive(true);
+    adaptive.set_contexts(true);
+    std::vector<uint8_t> packed;
+    CHECK_THROWS_AS(adaptive.zip(packed.data(), packed.size(), packed), std::invalid_argument);
+
+    // The cluster count and the context map are checked when the header is read.
+    std::ifstream in("data/AStudyInScarlet.txt", std::ios::binary);
+    std::vector<uint8_t> source(8000);
+    in.read((char *)source.data(), source.size());
+    huffman::HuffmanArchiver archiver;
+    archiver.set_contexts(true);
+    archiver.zip(source.data(), source.size(), packed);
+    size_t marker = 2;
+    REQUIRE_EQ(packed[marker] & 0xC0, 0x40);
+    std::vector<uint8_t> unpacked;
+    archiver.unzip(packed.data(), packed.size(), unpacked);
+    CHECK_EQ(unpacked, source);
+    for (uint8_t clusters : {0, 1, 17}) {
+        std::vector<uint8_t> damaged = packed;
+        damaged[marker + 1] = clusters;
+        CHECK_THROWS_AS(archiver.unzip(damaged.data(), damaged.size(), unpacked), std::ios_base::failure);
+    }
+    std::vector<uint8_t> damaged = packed;
+    damaged[marker + 2] = 0xF0 | (damaged[marker + 2] & 0xF);
+    CHECK_THROWS_AS(archiver.unzip(damaged.data(), damaged.size(), unpacked), std::ios_base::failure);
+}
+
+TEST_CASE("tokens and lexicon") {
+    std::string text = "the cat, the hat.";
+    huffman::Tokens tokens;
+    REQUIRE(huffman::tokenize((const uint8_t *)text.data(), text.size(), huffman::max_vocabulary, tokens));
+    auto token = [&tokens](uint32_t id) {
+        const uint8_t *slot = &tokens.lexicon[id * huffman::token_slot];
+        return std::string((const char *)slot, slot[huffman::max_token_size]);
+    };
+    std::vector<std::string> vocabulary = {" ", ", ", ".", "cat", "hat", "the"};
+    REQUIRE_EQ(tokens.counts.size(), vocabulary.size());
+    for (uint32_t id = 0; id < vocabulary.size(); id++) CHECK_EQ(token(id), vocabulary[id]);
+    CHECK(tokens.counts == std::vector<uint64_t>({2, 1, 1, 1, 1, 2}));
+    CHECK(tokens.ids == std::vector<uint32_t>({5, 0, 3, 1, 5, 0, 4, 2}));
+    CHECK_FALSE(huffman::tokenize((const uint8_t *)text.data(), text.size(), 5, tokens));
+
+    // Long runs are split, the bytes of a block come back in order.
+    std::string long_word(40, 'x');
+    REQUIRE(huffman::tokenize((const uint8_t *)long_word.data(), long_word.size(), huffman::max_vocabulary, tokens));
+    CHECK(tokens.ids == std::vector<uint32_t>({1, 1, 0}));
+    CHECK_EQ(token(0), std::string(10, 'x'));
+    CHECK_EQ(token(1), std::string(15, 'x'));
+
+    std::vector<uint8_t> buffer, lexicon;
+    std::string words = "a an and ant any be bee been";
+    REQUIRE(huffman::tokenize((const uint8_t *)words.data(), words.size(), huffman::max_vocabulary, tokens));
+    huffman::LexiconScratch scratch;
+    huffman::ByteWriter out(buffer);
+    huffman::write_lexicon(out, tokens.lexicon, scratch);
+    out.flush();
+    huffman::read_lexicon(buffer.data(), buffer.size(), tokens.counts.size(), lexicon, scratch);
+    CHECK(lexicon == tokens.lexicon);
+    CHECK_THROWS_AS(huffman::read_lexicon(buffer.data(), buffer.size() - 3, tokens.counts.size(), lexicon, scratch),
+                    std::ios_base::failure);
+
+    // Every symbol of a lexicon has a code, so the lengths are stored without symbols. These do not make a complete
+    // code and are rejected.
+    for (uint8_t longest : {15, 20}) {
+        std::vector<uint8_t> lengths(3001, 12);
+        lengths.back() = longest;
+        std::vector<uint8_t> stored, restored;
+        huffman::ByteWriter lengths_out(stored);
+        huffman::write_dense_lengths(lengths_out, lengths);
+        lengths_out.flush();
+        CHECK_EQ(stored.size(), 1 + (longest <= 15 ? 1501 : 3001));
+        huffman::ByteReader lengths_in(stored.data(), stored.size());
+        CHECK_THROWS_AS(huffman::read_dense_lengths(lengths_in, lengths.size(), restored), std::ios_base::failure);
+    }
+    std::vector<uint8_t> lengths = {1, 2, 3, 3}, stored, restored;
+    huffman::ByteWriter lengths_out(stored);
+    huffman::write_dense_lengths(lengths_out, lengths);
+    lengths_out.flush();
+    huffman::ByteReader lengths_in(stored.data(), stored.size());
+    huffman::read_dense_lengths(lengths_in, lengths.size(), restored);
+    CHECK(restored == lengths);
+}
+
+TEST_CASE("word token modeling") {
+    for (const char *file : {"data/empty.txt", "data/OneSymbolFile.txt", "data/AStudyInScarlet.txt", "data/file.bin", "data/EveryChar.bin"}) {
+        CAPTURE(file);
+        std::ifstream in(file, std::ios::binary);
+        std::vector<uint8_t> source((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        for (int streams : {1, 3, 4, 8}) {
+            for (bool contexts : {false, true}) {
+                CAPTURE(streams);
+                CAPTURE(contexts);
+                huffman::HuffmanArchiver plain, modeled;
+                for (huffman::HuffmanArchiver *archiver : {&plain, &modeled}) {
+                    archiver->set_streams(streams);
+                    archiver->set_block_size(1 << 16);
+                    archiver->set_threads(2);
+                    archiver->set_index(true);
+                    archiver->set_contexts(contexts);
+                }
+                modeled.set_tokens(true);
+                std::vector<uint8_t> reference, packed, unpacked;
+                plain.zip(source.data(), source.size(), reference);
+                huffman::StatHandler stats = modeled.zip(source.data(), source.size(), packed);
+                CHECK(packed.size() <= reference.size());
+                if (std::string(file) == "data/AStudyInScarlet.txt" && !contexts) CHECK(packed.size() < reference.size() * 4 / 5);
+                CHECK_EQ(stats.outputData + stats.additionalData, packed.size());
+                huffman::StatHandler unpacked_stats = plain.unzip(packed.data(), packed.size(), unpacked);
+                CHECK_EQ(unpacked, source);
+                CHECK_EQ(unpacked_stats.additionalData, stats.additionalData);
+
+                std::stringstream input(std::string(source.begin(), source.end())), archive, restored;
+                modeled.zip(input, archive);
+                CHECK_EQ(archive.str(), std::string(packed.begin(), packed.end()));
+                plain.unzip(archive, restored);
+                CHECK_EQ(restored.str(), std::string(source.begin(), source.end()));
+
+                if (source.size() > 100000) {
+                    std::ofstream("out.bin", std::ios::binary).write((const char *)packed.data(), packed.size());
+                    std::stringstream range;
+                    plain.unzip_range("out.bin", range, 70000, 30000);
+                    CHECK_EQ(range.str(), std::string(source.begin() + 70000, source.begin() + 100000));
+                }
+            }
+        }
+    }
+
+    huffman::HuffmanArchiver adaptive;
+    adaptive.set_adaptive(true);
+    adaptive.set_tokens(true);
+    std::vector<uint8_t> packed;
+    CHECK_THROWS_AS(adaptive.zip(packed.data(), packed.size(), packed), std::invalid_argument);
+
+    // The lexicon size and the token count are checked when the header is read, a token count that does not add up
+    // to the byte count is caught once the block is decoded.
+    std::ifstream in("data/AStudyInScarlet.txt", std::ios::binary);
+    std::vector<uint8_t> source((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    huffman::HuffmanArchiver archiver;
+    archiver.set_streams(1);
+    archiver.set_tokens(true);
+    archiver.zip(source.data(), source.size(), packed);
+    size_t marker = 3;
+    REQUIRE_EQ(packed[marker], 0x21);
+    std::vector<uint8_t> unpacked;
+    archiver.unzip(packed.data(), packed.size(), unpacked);
+    CHECK_EQ(unpacked, source);
+    std::vector<uint8_t> damaged = packed;
+    damaged[marker] = 0x61;
+    CHECK_THROWS_AS(archiver.unzip(damaged.data(), damaged.size(), unpacked), std::ios_base::failure);
+    damaged = packed;
+    damaged[marker + 1] = 0;
+    CHECK_THROWS_AS(archiver.unzip(damaged.data(), damaged.size(), unpacked), std::ios_base::failure);
+    huffman::ByteReader header(packed.data() + marker + 1, packed.size() - marker - 1);
+    uint64_t vocabulary = huffman::read_varint(header);
+    header.skip(huffman::read_varint(header));
+    huffman::read_dense_lengths(header, vocabulary, damaged);
+    REQUIRE_EQ(huffman::read_varint(header), source.size());
+    size_t count = marker + 1 + header.position();
+    uint64_t tokens = huffman::read_varint(header);
+    for (uint64_t wrong : {tokens - 1, tokens + 1, source.size() + 1}) {
+        damaged = packed;
+        REQUIRE_EQ(huffman::varint_size(wrong), huffman::varint_size(tokens));
+        huffman::ByteWriter varint(damaged.data() + count, huffman::varint_size(tokens));
+        huffman::write_varint(varint, wrong);
+        CHECK_THROWS_AS(archiver.unzip(damaged.data(), damaged.size(), unpacked), std::ios_base::failure);
+    }
+}
+
+TEST_CASE("sparse alphabets of wide symbols") {
+    std::vector<uint16_t> narrow = {700, 3, 65535, 700, 3, 700};
+    huffman::SymbolAlphabet<uint16_t> narrow_alphabet;
+    REQUIRE(huffman::count_symbols((const uint8_t *)narrow.data(), narrow.size(), 1 << 20, narrow_alphabet));
+    CHECK(narrow_alphabet.symbols == std::vector<uint16_t>({3, 700, 65535}));
+    CHECK(narrow_alphabet.counts == std::vector<uint64_t>({2, 3, 1}));
+    CHECK(narrow_alphabet.ids == std::vector<uint32_t>({1, 0, 2, 1, 0, 1}));
+
+    std::vector<uint32_t> wide;
+    for (uint32_t i = 0; i < 10000; i++) wide.push_back((i % 5000) * 2654435761u);
+    huffman::SymbolAlphabet<uint32_t> wide_alphabet;
+    REQUIRE(huffman::count_symbols((const uint8_t *)wide.data(), wide.size(), 1 << 20, wide_alphabet));
+    REQUIRE_EQ(wide_alphabet.symbols.size(), 5000);
+    CHECK(std::is_sorted(wide_alphabet.symbols.begin(), wide_alphabet.symbols.end()));
+    CHECK(std::all_of(wide_alphabet.counts.begin(), wide_alphabet.counts.end(), [](uint64_t cnt) { return cnt == 2; }));
+    for (size_t i = 0; i < wide.size(); i++) CHECK_EQ(wide_alphabet.symbols[wide_alphabet.ids[i]], wide[i]);
+    CHECK_FALSE(huffman::count_symbols((const uint8_t *)wide.data(), wide.size(), 4999, wide_alphabet));
+
+    // Only the present symbols are stored, as gaps.
+    std::vector<uint8_t> buffer;
+    huffman::ByteWriter out(buffer);
+    huffman::write_alphabet(out, narrow_alphabet.symbols);
+    out.flush();
+    CHECK_EQ(buffer.size(), 1 + 2 + 3);
+    std::vector<uint16_t> symbols;
+    huffman::ByteReader in(buffer.data(), buffer.size());
+    huffman::read_alphabet(in, 3, symbols);
+    CHECK(symbols == narrow_alphabet.symbols);
+    huffman::ByteReader past_end(buffer.data(), buffer.size());
+    CHECK_THROWS_AS(huffman::read_alphabet(past_end, 4, symbols), std::ios_base::failure);
+    std::vector<uint8_t> too_large = {0xFF, 0xFF, 0x03, 0x00};
+    huffman::ByteReader overflow(too_large.data(), too_large.size());
+    CHECK_THROWS_AS(huffman::read_alphabet(overflow, 2, symbols), std::ios_base::failure);
+    CHECK_FALSE(huffman::count_symbols((const uint8_t *)narrow.data(), narrow.size(), 2, narrow_alphabet));
+}
+
+TEST_CASE("wide symbol blocks") {
+    // Identifiers drawn from a few hundred scattered values, skewed towards the first ones.
+    std::vector<uint32_t> values;
+    for (uint32_t i = 0; i < 300; i++) values.push_back(i * 2654435761u);
+    std::srand(7);
+    std::vector<uint32_t> wide;
+    for (int i = 0; i < 100000; i++) wide.push_back(values[std::rand() % (1 + std::rand() % values.size())]);
+    std::vector<uint16_t> narrow(wide.begin(), wide.end());
+
+    std::ifstream in("data/AStudyInScarlet.txt", std::ios::binary);
+    std::vector<uint8_t> text((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    std::vector<uint8_t> narrow_bytes((const uint8_t *)narrow.data(), (const uint8_t *)(narrow.data() + narrow.size()));
+    std::vector<uint8_t> wide_bytes((const uint8_t *)wide.data(), (const uint8_t *)(wide.data() + wide.size()));
+    for (int width : {2, 4}) {
+        for (size_t trim : {0, 1, 3}) {
+            for (int streams : {1, 3, 8}) {
+                CAPTURE(width);
+                CAPTURE(trim);
+                CAPTURE(streams);
+                std::vector<uint8_t> source = width == 2 ? narrow_bytes : wide_bytes;
+                source.resize(source.size() - trim);
+                huffman::HuffmanArchiver plain, modeled;
+                for (huffman::HuffmanArchiver *archiver : {&plain, &modeled}) {
+                    archiver->set_streams(streams);
+                    archiver->set_block_size(1 << 16);
+                    archiver->set_threads(2);
+                    archiver->set_index(true);
+                }
+                modeled.set_symbol_width(width);
+                std::vector<uint8_t> reference, packed, unpacked;
+                plain.zip(source.data(), source.size(), reference);
+                huffman::StatHandler stats = modeled.zip(source.data(), source.size(), packed);
+                CHECK(packed.size() < reference.size() * 3 / 4);
+                CHECK_EQ(stats.outputData + stats.additionalData, packed.size());
+                huffman::StatHandler unpacked_stats = plain.unzip(packed.data(), packed.size(), unpacked);
+                CHECK_EQ(unpacked, source);
+                CHECK_EQ(unpacked_stats.additionalData, stats.additionalData);
+
+                std::stringstream input(std::string(source.begin(), source.end())), archive, restored;
+                modeled.zip(input, archive);
+                CHECK_EQ(archive.str(), std::string(packed.begin(), packed.end()));
+                plain.unzip(archive, restored);
+                CHECK_EQ(restored.str(), std::string(source.begin(), source.end()));
+
+                std::ofstream("out.bin", std::ios::binary).write((const char *)packed.data(), packed.size());
+                std::stringstream range;
+                plain.unzip_range("out.bin", range, 70001, 30000);
+                CHECK_EQ(range.str(), std::string(source.begin() + 70001, source.begin() + 100001));
+
+                // Other data is coded either way, whichever is smaller.
+                modeled.zip(text.data(), text.size(), packed);
+                plain.zip(text.data(), text.size(), reference);
+                CHECK(packed.size() <= reference.size());
+                plain.unzip(packed.data(), packed.size(), unpacked);
+                CHECK_EQ(unpacked, text);
+            }
+        }
+    }
+
+    huffman::HuffmanArchiver archiver;
+    for (int width : {0, 3, 8}) CHECK_THROWS_AS(archiver.set_symbol_width(width), std::invalid_argument);
+    archiver.set_adaptive(true);
+    archiver.set_symbol_width(2);
+    std::vector<uint8_t> packed;
+    CHECK_THROWS_AS(archiver.zip(narrow_bytes.data(), narrow_bytes.size(), packed), std::invalid_argument);
+
+    archiver.set_adaptive(false);
+    archiver.set_streams(1);
+    archiver.zip(narrow_bytes.data(), narrow_bytes.size(), packed);
+    size_t marker = 3;
+    REQUIRE_EQ(packed[marker], 0x11);
+    REQUIRE_EQ(packed[marker + 1], 2);
+    for (uint8_t width : {1, 3, 8}) {
+        std::vector<uint8_t> damaged = packed, unpacked;
+        damaged[marker + 1] = width;
+        CHECK_THROWS_AS(archiver.unzip(damaged.data(), damaged.size(), unpacked), std::ios_base::failure);
+    }
+}
+
+// Every allocation of the test binary goes through here, so a test can tell whether a piece of code allocates.
+// The replacements are kept out of line: inlined into their callers, malloc and free meet the built-in new and delete
+// and GCC reports them as mismatched.
+static std::atomic<size_t> allocations{0};
+
+[[gnu::noinline]] void * operator new(size_t size) {
+    allocations++;
+    if (void *ptr = std::malloc(size == 0 ? 1 : size)) return ptr;
+    throw std::bad_alloc();
+}
+
+[[gnu::noinline]] void operator delete(void *ptr) noexcept {
+    std::free(ptr);
+}
+
+[[gnu::noinline]] void operator delete(void *ptr, size_t) noexcept {
+    ::operator delete(ptr);
+}
+
+TEST_CASE("in-memory coding does not allocate once warmed up") {
+    std::ifstream text("data/AStudyInScarlet.txt", std::ios::binary);
+    std::vector<uint8_t> source((std::istreambuf_iterator<char>(text)), std::istreambuf_iterator<char>());
+    std::vector<std::vector<uint8_t>> messages = {{}, std::vector<uint8_t>(100, 'a')};
+    for (size_t offset = 0, size = 40; offset + size <= source.size() && size <= 40000; offset += size, size *= 3) {
+        messages.emplace_back(source.begin() + offset, source.begin() + offset + size);
+    }
+    for (int max_length : {huffman::HuffmanArchiver::default_max_code_length, 7}) {
+        for (bool adaptive : {false, true}) {
+            CAPTURE(max_length);
+            CAPTURE(adaptive);
+            huffman::HuffmanArchiver archiver;
+            archiver.set_max_code_length(max_length);
+            archiver.set_adaptive(adaptive);
+            std::vector<uint8_t> packed(1 << 20), unpacked(1 << 20), sink;
+            sink.reserve(1 << 20);
+            size_t before = 0, failures = 0;
+            for (int round = 0; round < 3; round++) {
+                // The first round grows the buffers, the following ones must reuse them.
+                if (round == 1) before = allocations;
+                for (const std::vector<uint8_t> &message : messages) {
+                    huffman::StatHandler zipped = archiver.zip(message.data(), message.size(), packed.data(), packed.size());
+                    size_t archive_size = zipped.outputData + zipped.additionalData;
+                    huffman::StatHandler unzipped = archiver.unzip(packed.data(), archive_size, unpacked.data(), unpacked.size());
+                    archiver.zip(message.data(), message.size(), sink);
+                    if (unzipped.outputData != message.size() || !std::equal(message.begin(), message.end(), unpacked.begin())) failures++;
+                    if (sink.size() != archive_size || !std::equal(sink.begin(), sink.end(), packed.begin())) failures++;
+                }
+            }
+            size_t after = allocations;
+            CHECK_EQ(after - before, 0);
+            CHECK_EQ(failures, 0);
+        }
+    }
+}